@@ -0,0 +1,669 @@
+/* Benchmark harness comparing sarena against glibc malloc, jemalloc (if built
+ * with SARENA_BENCH_JEMALLOC) and a plain bump pointer.
+ *
+ * Usage: bench [filter]
+ *
+ * If 'filter' is given, only the cases whose name contains it are run. Each
+ * case reports the time per allocation, the allocation throughput and the
+ * growth of the resident set size while the allocations were live.
+ *
+ * Every run happens in a child process, so that neither the RSS nor the heap
+ * state (e.g. glibc's dynamic mmap threshold) carries over between runs. */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#ifdef SARENA_BENCH_JEMALLOC
+#include <jemalloc/jemalloc.h>
+#endif
+
+#include "sarena.h"
+
+#define BENCH_THREADS 4
+#define BENCH_REGION_CAP (1 << 20)
+#define BENCH_MIXED_SIZES 4096
+
+/* -------------------------------------------------------------------------- */
+
+/* An allocator under test. 'release' frees every allocation made since the
+ * last release, in whatever way is cheapest for the allocator. */
+
+typedef struct bench_alloc
+{
+    const char* name;
+
+    void* (*create)(void);
+    void* (*alloc)(void* ctx, size_t size);
+    void (*release)(void* ctx);
+    void (*destroy)(void* ctx);
+} bench_alloc;
+
+typedef struct bench_case
+{
+    const char* name;
+
+    /* Runs the case, returning the number of allocations made. 'rss' is set to
+     * the resident set size growth (in bytes) while allocations were live. */
+    size_t (*run)(const bench_alloc* alloc, size_t* rss);
+} bench_case;
+
+/* -------------------------------------------------------------------------- */
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static size_t bench_rss(void)
+{
+    FILE* file = fopen("/proc/self/statm", "r");
+    if(file == NULL) return 0;
+
+    unsigned long size = 0, resident = 0;
+    int status = fscanf(file, "%lu %lu", &size, &resident);
+    fclose(file);
+
+    if(status != 2) return 0;
+
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static size_t bench_rss_growth(size_t before)
+{
+    size_t after = bench_rss();
+
+    return (after > before) ? (after - before) : 0;
+}
+
+/* Touches the allocation, so the allocator cannot be optimized away and pages
+ * are actually faulted in. */
+static void bench_touch(void* ptr)
+{
+    if(ptr == NULL)
+    {
+        fprintf(stderr, "bench: allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    *(volatile char*)ptr = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Allocators */
+
+/* ----------------------------------------------------------------
+ * malloc() / jemalloc - allocations are remembered, so they can be freed on
+ * release.
+ * ---------------------------------------------------------------- */
+
+typedef struct bench_heap
+{
+    void** ptrs;
+    size_t count;
+    size_t cap;
+} bench_heap;
+
+static void* bench_heap_create(void)
+{
+    return calloc(1, sizeof(bench_heap));
+}
+
+static void bench_heap_push(bench_heap* heap, void* ptr)
+{
+    if(heap->count == heap->cap)
+    {
+        size_t cap = (heap->cap == 0) ? 1024 : heap->cap * 2;
+        void** ptrs = realloc(heap->ptrs, cap * sizeof(void*));
+        if(ptrs == NULL)
+        {
+            fprintf(stderr, "bench: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        heap->ptrs = ptrs;
+        heap->cap = cap;
+    }
+
+    heap->ptrs[heap->count++] = ptr;
+}
+
+static void bench_heap_destroy(void* ctx)
+{
+    bench_heap* heap = ctx;
+
+    free(heap->ptrs);
+    free(heap);
+}
+
+static void* bench_malloc_alloc(void* ctx, size_t size)
+{
+    void* ptr = malloc(size);
+    bench_heap_push(ctx, ptr);
+
+    return ptr;
+}
+
+static void bench_malloc_release(void* ctx)
+{
+    bench_heap* heap = ctx;
+
+    size_t i;
+    for(i = 0; i < heap->count; i++)
+        free(heap->ptrs[i]);
+
+    heap->count = 0;
+}
+
+#ifdef SARENA_BENCH_JEMALLOC
+
+static void* bench_jemalloc_alloc(void* ctx, size_t size)
+{
+    void* ptr = mallocx(size, 0);
+    bench_heap_push(ctx, ptr);
+
+    return ptr;
+}
+
+static void bench_jemalloc_release(void* ctx)
+{
+    bench_heap* heap = ctx;
+
+    size_t i;
+    for(i = 0; i < heap->count; i++)
+        dallocx(heap->ptrs[i], 0);
+
+    heap->count = 0;
+}
+
+#endif // SARENA_BENCH_JEMALLOC
+
+/* ----------------------------------------------------------------
+ * Bump pointer - a single fixed block, the lower bound for any arena.
+ * ---------------------------------------------------------------- */
+
+#define BENCH_BUMP_CAP ((size_t)1 << 30)
+
+typedef struct bench_bump
+{
+    char* base;
+    size_t used;
+} bench_bump;
+
+static void* bench_bump_create(void)
+{
+    bench_bump* bump = malloc(sizeof(bench_bump));
+    if(bump == NULL) return NULL;
+
+    // untouched pages of a large malloc() block are not resident
+    bump->base = malloc(BENCH_BUMP_CAP);
+    bump->used = 0;
+
+    if(bump->base == NULL)
+    {
+        free(bump);
+        return NULL;
+    }
+
+    return bump;
+}
+
+static void* bench_bump_alloc(void* ctx, size_t size)
+{
+    bench_bump* bump = ctx;
+
+    size_t offset = (bump->used + 15) & ~(size_t)15;
+    if(size > BENCH_BUMP_CAP - offset) return NULL;
+
+    bump->used = offset + size;
+
+    return bump->base + offset;
+}
+
+static void bench_bump_release(void* ctx)
+{
+    ((bench_bump*)ctx)->used = 0;
+}
+
+static void bench_bump_destroy(void* ctx)
+{
+    bench_bump* bump = ctx;
+
+    free(bump->base);
+    free(bump);
+}
+
+/* ----------------------------------------------------------------
+ * sarena
+ * ---------------------------------------------------------------- */
+
+static void* bench_sarena_create(void)
+{
+    return sarena_create(BENCH_REGION_CAP);
+}
+
+static void* bench_sarena_create_cached(void)
+{
+    sarena_options opts = {
+        .region_cap = BENCH_REGION_CAP,
+        .region_cache = sarena_region_cache_global()
+    };
+
+    sarena_region_cache_set_retain(opts.region_cache, 64 * BENCH_REGION_CAP);
+
+    return sarena_create_with(&opts);
+}
+
+static void* bench_sarena_create_concurrent(void)
+{
+    return sarena_create_concurrent(BENCH_REGION_CAP);
+}
+
+static void* bench_sarena_alloc(void* ctx, size_t size)
+{
+    return sarena_malloc(ctx, size);
+}
+
+static void* bench_sarena_tls_alloc(void* ctx, size_t size)
+{
+    return sarena_tls_malloc(ctx, size);
+}
+
+static void bench_sarena_release(void* ctx)
+{
+    sarena_rewind(ctx);
+}
+
+static void bench_sarena_destroy(void* ctx)
+{
+    sarena_destroy(ctx);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static const bench_alloc bench_allocs[] = {
+    { "malloc", bench_heap_create, bench_malloc_alloc,
+        bench_malloc_release, bench_heap_destroy },
+#ifdef SARENA_BENCH_JEMALLOC
+    { "jemalloc", bench_heap_create, bench_jemalloc_alloc,
+        bench_jemalloc_release, bench_heap_destroy },
+#endif
+    { "bump", bench_bump_create, bench_bump_alloc,
+        bench_bump_release, bench_bump_destroy },
+    { "sarena", bench_sarena_create, bench_sarena_alloc,
+        bench_sarena_release, bench_sarena_destroy },
+    { "sarena-cache", bench_sarena_create_cached, bench_sarena_alloc,
+        bench_sarena_release, bench_sarena_destroy },
+};
+
+#define BENCH_ALLOC_COUNT (sizeof(bench_allocs) / sizeof(bench_allocs[0]))
+
+/* Allocators for the multi-threaded case. Heap allocators get one context per
+ * thread, since their bookkeeping is not thread-safe - the allocator itself is
+ * still shared. The arenas are shared by all threads. */
+
+static const bench_alloc bench_mt_allocs[] = {
+    { "malloc", bench_heap_create, bench_malloc_alloc,
+        bench_malloc_release, bench_heap_destroy },
+#ifdef SARENA_BENCH_JEMALLOC
+    { "jemalloc", bench_heap_create, bench_jemalloc_alloc,
+        bench_jemalloc_release, bench_heap_destroy },
+#endif
+    { "sarena-conc", bench_sarena_create_concurrent, bench_sarena_alloc,
+        bench_sarena_release, bench_sarena_destroy },
+    { "sarena-tls", bench_sarena_create_concurrent, bench_sarena_tls_alloc,
+        bench_sarena_release, bench_sarena_destroy },
+};
+
+#define BENCH_MT_ALLOC_COUNT (sizeof(bench_mt_allocs) / sizeof(bench_mt_allocs[0]))
+
+/* -------------------------------------------------------------------------- */
+
+/* Cases */
+
+static size_t bench_mixed_sizes[BENCH_MIXED_SIZES];
+
+static void bench_init_mixed_sizes(void)
+{
+    uint32_t state = 0x9e3779b9u;
+
+    size_t i;
+    for(i = 0; i < BENCH_MIXED_SIZES; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        // mostly small objects, with an occasional larger one
+        bench_mixed_sizes[i] = ((state & 7) == 0) ?
+            (256 + state % 3840) : (8 + state % 248);
+    }
+}
+
+#define BENCH_BURST_ROUNDS 20
+#define BENCH_BURST_ALLOCS 500000
+
+static size_t bench_burst(const bench_alloc* alloc, size_t* rss, int mixed)
+{
+    size_t rss_before = bench_rss();
+    void* ctx = alloc->create();
+
+    size_t round, i;
+    for(round = 0; round < BENCH_BURST_ROUNDS; round++)
+    {
+        for(i = 0; i < BENCH_BURST_ALLOCS; i++)
+        {
+            size_t size = mixed ?
+                bench_mixed_sizes[i % BENCH_MIXED_SIZES] : 64;
+            bench_touch(alloc->alloc(ctx, size));
+        }
+
+        if(round == 0)
+            *rss = bench_rss_growth(rss_before);
+
+        alloc->release(ctx);
+    }
+
+    alloc->destroy(ctx);
+
+    return BENCH_BURST_ROUNDS * BENCH_BURST_ALLOCS;
+}
+
+static size_t bench_fixed(const bench_alloc* alloc, size_t* rss)
+{
+    return bench_burst(alloc, rss, 0);
+}
+
+static size_t bench_mixed(const bench_alloc* alloc, size_t* rss)
+{
+    return bench_burst(alloc, rss, 1);
+}
+
+/* Many short-lived scopes, as in per-request or per-frame allocation. */
+
+#define BENCH_CYCLE_ROUNDS 100000
+#define BENCH_CYCLE_ALLOCS 100
+
+static size_t bench_cycles(const bench_alloc* alloc, size_t* rss)
+{
+    size_t rss_before = bench_rss();
+    void* ctx = alloc->create();
+
+    size_t round, i;
+    for(round = 0; round < BENCH_CYCLE_ROUNDS; round++)
+    {
+        for(i = 0; i < BENCH_CYCLE_ALLOCS; i++)
+            bench_touch(alloc->alloc(ctx, bench_mixed_sizes[i]));
+
+        alloc->release(ctx);
+    }
+
+    *rss = bench_rss_growth(rss_before);
+    alloc->destroy(ctx);
+
+    return BENCH_CYCLE_ROUNDS * BENCH_CYCLE_ALLOCS;
+}
+
+/* A fresh allocator for each round, so every round pays for growing it. */
+
+#define BENCH_GROWTH_ROUNDS 20
+#define BENCH_GROWTH_ALLOCS 200000
+
+static size_t bench_growth(const bench_alloc* alloc, size_t* rss)
+{
+    *rss = 0;
+
+    size_t round, i;
+    for(round = 0; round < BENCH_GROWTH_ROUNDS; round++)
+    {
+        size_t rss_before = bench_rss();
+        void* ctx = alloc->create();
+
+        for(i = 0; i < BENCH_GROWTH_ALLOCS; i++)
+            bench_touch(alloc->alloc(ctx, 128));
+
+        if(round == 0)
+            *rss = bench_rss_growth(rss_before);
+
+        alloc->release(ctx);
+        alloc->destroy(ctx);
+    }
+
+    return BENCH_GROWTH_ROUNDS * BENCH_GROWTH_ALLOCS;
+}
+
+/* Many short-lived allocators, each created, filled a little and destroyed. */
+
+#define BENCH_CHURN_ROUNDS 100000
+#define BENCH_CHURN_ALLOCS 50
+
+static size_t bench_churn(const bench_alloc* alloc, size_t* rss)
+{
+    size_t rss_before = bench_rss();
+
+    size_t round, i;
+    for(round = 0; round < BENCH_CHURN_ROUNDS; round++)
+    {
+        void* ctx = alloc->create();
+
+        for(i = 0; i < BENCH_CHURN_ALLOCS; i++)
+            bench_touch(alloc->alloc(ctx, bench_mixed_sizes[i]));
+
+        alloc->release(ctx);
+        alloc->destroy(ctx);
+    }
+
+    *rss = bench_rss_growth(rss_before);
+
+    return BENCH_CHURN_ROUNDS * BENCH_CHURN_ALLOCS;
+}
+
+/* ----------------------------------------------------------------
+ * Multi-threaded contention
+ * ---------------------------------------------------------------- */
+
+#define BENCH_MT_ROUNDS 10
+#define BENCH_MT_ALLOCS 200000
+
+typedef struct bench_mt_thread
+{
+    const bench_alloc* alloc;
+    void* ctx;
+    pthread_barrier_t* barrier;
+} bench_mt_thread;
+
+static void* bench_mt_worker(void* arg)
+{
+    bench_mt_thread* thread = arg;
+
+    size_t round, i;
+    for(round = 0; round < BENCH_MT_ROUNDS; round++)
+    {
+        pthread_barrier_wait(thread->barrier);
+
+        for(i = 0; i < BENCH_MT_ALLOCS; i++)
+        {
+            void* ptr = thread->alloc->alloc(thread->ctx,
+                    bench_mixed_sizes[i % BENCH_MIXED_SIZES] / 4 + 8);
+            bench_touch(ptr);
+        }
+
+        pthread_barrier_wait(thread->barrier);
+        pthread_barrier_wait(thread->barrier); // wait for the release
+    }
+
+    return NULL;
+}
+
+static size_t bench_mt(const bench_alloc* alloc, size_t* rss)
+{
+    int shared = (alloc->create != bench_heap_create);
+
+    pthread_t tids[BENCH_THREADS];
+    bench_mt_thread threads[BENCH_THREADS];
+    pthread_barrier_t barrier;
+
+    pthread_barrier_init(&barrier, NULL, BENCH_THREADS + 1);
+
+    size_t rss_before = bench_rss();
+    void* shared_ctx = shared ? alloc->create() : NULL;
+
+    size_t i;
+    for(i = 0; i < BENCH_THREADS; i++)
+    {
+        threads[i].alloc = alloc;
+        threads[i].ctx = shared ? shared_ctx : alloc->create();
+        threads[i].barrier = &barrier;
+
+        pthread_create(&tids[i], NULL, bench_mt_worker, &threads[i]);
+    }
+
+    size_t round;
+    for(round = 0; round < BENCH_MT_ROUNDS; round++)
+    {
+        pthread_barrier_wait(&barrier); // start
+        pthread_barrier_wait(&barrier); // done
+
+        if(round == 0)
+            *rss = bench_rss_growth(rss_before);
+
+        if(shared)
+            alloc->release(shared_ctx);
+        else
+        {
+            for(i = 0; i < BENCH_THREADS; i++)
+                alloc->release(threads[i].ctx);
+        }
+
+        pthread_barrier_wait(&barrier);
+    }
+
+    for(i = 0; i < BENCH_THREADS; i++)
+    {
+        pthread_join(tids[i], NULL);
+
+        if(!shared)
+            alloc->destroy(threads[i].ctx);
+    }
+
+    if(shared)
+        alloc->destroy(shared_ctx);
+
+    pthread_barrier_destroy(&barrier);
+
+    return BENCH_THREADS * BENCH_MT_ROUNDS * BENCH_MT_ALLOCS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static const bench_case bench_cases[] = {
+    { "fixed-burst", bench_fixed },
+    { "mixed-burst", bench_mixed },
+    { "rewind-cycles", bench_cycles },
+    { "region-growth", bench_growth },
+    { "arena-churn", bench_churn },
+};
+
+#define BENCH_CASE_COUNT (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+typedef struct bench_result
+{
+    size_t count;
+    size_t rss;
+    double elapsed;
+} bench_result;
+
+static void bench_report(const char* case_name, const bench_alloc* alloc,
+        size_t (*run)(const bench_alloc*, size_t*))
+{
+    int fds[2];
+    if(pipe(fds) != 0)
+    {
+        perror("bench: pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        perror("bench: fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if(pid == 0)
+    {
+        bench_result result = { 0, 0, 0 };
+
+        double start = bench_now();
+        result.count = run(alloc, &result.rss);
+        result.elapsed = bench_now() - start;
+
+        ssize_t written = write(fds[1], &result, sizeof(result));
+        _exit((written == sizeof(result)) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(fds[1]);
+
+    bench_result result;
+    ssize_t nread = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    if((nread != sizeof(result)) || !WIFEXITED(status) ||
+            (WEXITSTATUS(status) != EXIT_SUCCESS))
+    {
+        printf("%-16s %-12s %10s\n", case_name, alloc->name, "failed");
+        return;
+    }
+
+    size_t count = result.count;
+    size_t rss = result.rss;
+    double elapsed = result.elapsed;
+
+    printf("%-16s %-12s %10.2f %12.2f %12zu\n", case_name, alloc->name,
+            elapsed / (double)count, (double)count / elapsed * 1e3,
+            rss / 1024);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* filter = (argc > 1) ? argv[1] : NULL;
+
+    bench_init_mixed_sizes();
+
+    printf("%-16s %-12s %10s %12s %12s\n", "case", "allocator",
+            "ns/alloc", "Malloc/s", "RSS KiB");
+
+    size_t i, j;
+    for(i = 0; i < BENCH_CASE_COUNT; i++)
+    {
+        if((filter != NULL) && (strstr(bench_cases[i].name, filter) == NULL))
+            continue;
+
+        for(j = 0; j < BENCH_ALLOC_COUNT; j++)
+            bench_report(bench_cases[i].name, &bench_allocs[j],
+                    bench_cases[i].run);
+    }
+
+    if((filter == NULL) || (strstr("mt-contention", filter) != NULL))
+    {
+        for(j = 0; j < BENCH_MT_ALLOC_COUNT; j++)
+            bench_report("mt-contention", &bench_mt_allocs[j], bench_mt);
+    }
+
+    return 0;
+}
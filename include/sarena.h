@@ -29,6 +29,7 @@
 #define SARENA_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,7 +37,7 @@ extern "C" {
 
 /* -------------------------------------------------------------------------- */
 
-/* SArena is a simple thread-safe arena allocator. It contains regions organized
+/* SArena is a simple arena allocator. It contains regions organized
  * into a region list. When the tail of the region list runs out of memory in
  * its internal memory pool, a new region is pushed back to the list.
  *
@@ -48,11 +49,81 @@ extern "C" {
  * This arena may perform poorly if 'region_cap' is too small relative to the
  * typical allocation size.
  *
- * It is important to note that each SArena object has its own mutex lock,
- * which ensures thread-safety. */
+ * Arenas created with sarena_create() are not thread-safe. Arenas created with
+ * sarena_create_concurrent() may be allocated from by multiple threads at the
+ * same time, without any locking. */
 
 struct sarena;
 typedef struct sarena sarena;
+typedef struct sarena_region_cache sarena_region_cache;
+typedef struct sarena_ring sarena_ring;
+typedef struct sarena_epoch sarena_epoch;
+typedef struct sarena_image sarena_image;
+
+/* -------------------------------------------------------------------------- */
+/* INTERNAL - exposed only for the inline fast path of sarena_malloc(). The
+ * fields of these structs must not be accessed directly. */
+/* -------------------------------------------------------------------------- */
+
+typedef struct sa_region sa_region;
+
+/* A region and its memory pool occupy a single block of memory. The header is
+ * placed so that the memory pool, which immediately follows it, is aligned to
+ * the arena's alignment. */
+
+struct sa_region
+{
+    size_t _used_cap;
+    size_t _total_cap;
+
+    /* Allocations ending beyond '_fast_cap' bytes take the out-of-line path.
+     * Equal to '_total_cap', except for the active region of an arena which
+     * prepares the next region once this point is reached, see
+     * 'sarena_options.prefetch_percent'. */
+    size_t _fast_cap;
+
+    sa_region* _next;
+
+    void* _mem_block;
+    size_t _block_size;
+    size_t _origin;
+
+    /* The memory pool beyond the first '_dirty_cap' bytes is known to be
+     * zero, which lets sarena_calloc() skip clearing it. */
+    size_t _dirty_cap;
+
+    /* Lowest '_used_cap' sarena_rewind_to() brought the region back to since
+     * the arena's '_floor_releases'-th release. Memory below it has not been
+     * released since, which pools rely on. Ignored for other releases. */
+    size_t _floor_cap;
+    size_t _floor_releases;
+
+    // flexible array members are a GNU extension in C++
+#ifdef __cplusplus
+    __extension__
+#endif
+    char _mem_pool[];
+};
+
+/* State read by every allocation. It is the first member of 'struct sarena',
+ * so it can be reached through a 'sarena*'. */
+
+typedef struct sa_hot
+{
+    /* Region currently being allocated from. Regions before it are
+     * considered full and regions after it are empty. When not rewinding,
+     * this is the tail of the region list. */
+    sa_region* _curr;
+
+    size_t _alignment;
+
+    /* If not 0, every allocation takes the out-of-line path. */
+    int _slow;
+
+    size_t _waste; // bytes lost to alignment padding and abandoned regions
+
+    size_t _alloc_count; // only maintained if SARENA_STATS is defined
+} sa_hot;
 
 /* -------------------------------------------------------------------------- */
 
@@ -75,6 +146,214 @@ sarena* sarena_create(size_t region_cap);
 
 /* -------------------------------------------------------------------------- */
 
+/* Default alignment used by sarena_create(). Every address returned by
+ * sarena_malloc() and sarena_calloc() will be a multiple of this value.
+ * It may be overridden by defining it before including this header. */
+
+#ifndef SARENA_DEFAULT_ALIGNMENT
+#define SARENA_DEFAULT_ALIGNMENT (2 * sizeof(void*))
+#endif
+
+/* Behaves like sarena_create(), but every address returned by sarena_malloc()
+ * and sarena_calloc() will be a multiple of 'alignment'. The memory pool of
+ * each region will also start at a multiple of 'alignment'.
+ *
+ * Return value:
+ * ON SUCCESS: address of the newly-allocated SArena;
+ * ON FAILURE: NULL. This can occur if the malloc for the first region fails,
+ * if 'region_cap' is 0 or if 'alignment' is not a power of 2. */
+
+sarena* sarena_create_aligned(size_t region_cap, size_t alignment);
+
+/* -------------------------------------------------------------------------- */
+
+/* Behaves like sarena_create(), but the created arena may be used by multiple
+ * threads concurrently. sarena_malloc(), sarena_malloc_aligned() and
+ * sarena_calloc() are lock-free on such an arena: an allocation is a single
+ * atomic add on the active region's used capacity. When the active region
+ * runs out of memory, the next region is installed atomically.
+ *
+ * Every allocation made from a concurrent arena is rounded up to a multiple
+ * of SARENA_DEFAULT_ALIGNMENT. Allocations that cause a region to overflow
+ * leave the rest of that region unused until the arena is rewinded.
+ *
+ * sarena_rewind(), sarena_reset() and sarena_destroy() are NOT lock-free and
+ * must not be called while other threads are using the arena.
+ *
+ * Return value:
+ * ON SUCCESS: address of the newly-allocated SArena;
+ * ON FAILURE: NULL. This can occur if the malloc for the first region fails
+ * or if 'region cap` is 0. */
+
+sarena* sarena_create_concurrent(size_t region_cap);
+
+/* -------------------------------------------------------------------------- */
+
+/* Huge page backing of region memory. See 'sarena_options.huge_pages'. */
+
+enum sarena_huge_pages
+{
+    SARENA_HUGE_PAGES_NONE = 0,
+    SARENA_HUGE_PAGES_TRANSPARENT,
+    SARENA_HUGE_PAGES_2MB,
+    SARENA_HUGE_PAGES_1GB
+};
+
+/* NUMA placement of region memory. See 'sarena_options.numa_policy'. */
+
+enum sarena_numa_policy
+{
+    SARENA_NUMA_NONE = 0,
+    SARENA_NUMA_LOCAL,
+    SARENA_NUMA_NODE
+};
+
+/* Backing allocator supplying the memory of an arena's regions and of the
+ * arena object itself. 'alloc' must return memory aligned like the memory
+ * returned by malloc(), or NULL on failure. 'free' receives the size that was
+ * passed to 'alloc'. 'ctx' is passed to both functions unchanged. */
+
+typedef struct sarena_allocator
+{
+    void* (*alloc)(void* ctx, size_t size);
+    void (*free)(void* ctx, void* ptr, size_t size);
+    void* ctx;
+} sarena_allocator;
+
+/* Returns a backing allocator which allocates from 'parent', for building
+ * hierarchies of arenas. Its 'free' function does nothing - the memory of the
+ * child arena is reclaimed when 'parent' is rewinded, reset or destroyed, which
+ * must not happen while the child arena is in use. */
+
+sarena_allocator sarena_allocator_of(sarena* parent);
+
+/* Creation options for sarena_create_with(). Zero-initialized fields take
+ * their default values, so only the fields of interest need to be set:
+ *
+ * sarena_options opts = { .region_cap = 4096, .growth_factor = 2 }; */
+
+typedef struct sarena_options
+{
+    /* Capacity of the first region. Must not be 0. */
+    size_t region_cap;
+
+    /* Each region pushed to the region list is 'growth_factor' times larger
+     * than the previous one, up to 'max_region_cap' bytes. A factor of 0 or 1
+     * makes all regions 'region_cap' bytes large. By default, there is no
+     * upper limit other than SIZE_MAX. */
+    size_t growth_factor;
+    size_t max_region_cap;
+
+    /* Default alignment of the arena. Defaults to SARENA_DEFAULT_ALIGNMENT. */
+    size_t alignment;
+
+    /* If not 0, the arena is created as if by sarena_create_concurrent(). */
+    int concurrent;
+
+    /* If not 0, the arena uses the virtual memory backend: 'reserve_cap' bytes
+     * of contiguous address space are reserved up front, and the arena holds a
+     * single region spanning all of it. Pages are committed 'region_cap' bytes
+     * at a time (rounded up to the page size) as allocations advance, and
+     * decommitted on sarena_reset(). Allocations beyond 'reserve_cap' fail.
+     * 'growth_factor' and 'max_region_cap' are ignored. */
+    size_t reserve_cap;
+
+    /* One of 'enum sarena_huge_pages'. If set, region memory is allocated with
+     * mmap() and region capacities are rounded up to the huge page size.
+     * SARENA_HUGE_PAGES_2MB and SARENA_HUGE_PAGES_1GB use MAP_HUGETLB, and fall
+     * back to transparent huge pages if the system has no huge pages of that
+     * size reserved. The virtual memory backend always uses transparent huge
+     * pages. Only supported on Linux, ignored elsewhere. */
+    int huge_pages;
+
+    /* One of 'enum sarena_numa_policy'. SARENA_NUMA_NODE binds region memory
+     * to NUMA node 'numa_node', SARENA_NUMA_LOCAL binds it to the node of the
+     * thread creating the arena. If set, region memory is allocated with
+     * mmap(). Only supported on Linux, ignored elsewhere. */
+    int numa_policy;
+    int numa_node;
+
+    /* If not NULL, regions freed by the arena are handed to 'region_cache'
+     * instead of being freed, and new regions are taken from it when it holds
+     * one of a matching capacity. The arena object itself is recycled the
+     * same way. The cache must outlive the arena. See sarena_region_cache_create(). */
+    sarena_region_cache* region_cache;
+
+    /* If not 0, every sarena_rewind() trims the arena (see sarena_trim()) to
+     * the highest usage seen over the last 'trim_window' rewinds, so capacity
+     * left over from a rare spike is freed once the spike has passed. At most
+     * SARENA_TRIM_WINDOW_MAX rewinds are considered. */
+    size_t trim_window;
+
+    /* If not NULL, region memory and the arena object are obtained from
+     * '*allocator' instead of malloc(). 'huge_pages', 'numa_policy' and
+     * 'region_cache' are then ignored. The virtual memory backend still
+     * reserves its address space itself. The allocator is copied, but its
+     * context must outlive the arena. */
+    const sarena_allocator* allocator;
+
+    /* Number of partially filled regions remembered for backfilling. When an
+     * allocation does not fit the active region, it is placed in the
+     * remembered region with the least free space that can still hold it,
+     * and when the active region is abandoned, it replaces the remembered
+     * region with the least free space, if it has more. More slots let small
+     * allocations fill the gaps left by mixed-size workloads. Defaults to 1,
+     * at most SARENA_SPARE_MAX regions are remembered. Ignored by concurrent
+     * arenas and by the virtual memory backend. */
+    size_t spare_regions;
+
+    /* If not NULL, other threads may read the arena's memory inside epoch
+     * sections of 'epoch', and sarena_rewind() and sarena_reset() defer the
+     * reuse of the memory they release until the readers inside a section at
+     * the time have left it. See sarena_epoch_create(). Not supported by
+     * concurrent arenas and by the virtual memory backend. The domain must
+     * outlive the arena. */
+    sarena_epoch* epoch;
+
+    /* If not 0, once 'prefetch_percent' percent of the active region is
+     * filled, the arena prepares the region it moves to next, so moving to
+     * it does not stall on page faults and cache misses: if the next region
+     * would only be allocated by then, it is allocated right away and its
+     * pages are touched, and if it exists, its first cache lines are
+     * prefetched. Values above 99 are clamped. The inline fast path of
+     * sarena_malloc() does not check anything more. Ignored by concurrent
+     * arenas and by the virtual memory backend. */
+    size_t prefetch_percent;
+
+    /* If not 0, the regions which 'prefetch_percent' would allocate are
+     * allocated and touched by a background thread owned by the arena
+     * instead, so the allocating thread pays for neither. A region prepared
+     * this way is only used if it is ready in time. Requires POSIX threads,
+     * and is ignored elsewhere and if 'allocator' is set. */
+    int prefetch_thread;
+} sarena_options;
+
+#define SARENA_TRIM_WINDOW_MAX 16
+#define SARENA_SPARE_MAX 8
+
+/* Dynamically allocates memory for 'struct sarena' and initializes it
+ * according to 'opts'. sarena_create(), sarena_create_aligned() and
+ * sarena_create_concurrent() are shorthands for this function.
+ *
+ * With a 'growth_factor' of 2, the number of regions grows logarithmically
+ * with the amount of memory held by the arena.
+ *
+ * Return value:
+ * ON SUCCESS: address of the newly-allocated SArena;
+ * ON FAILURE: NULL. This can occur if the malloc for the first region fails,
+ * if 'opts' is NULL, if 'opts->region_cap' is 0, if 'opts->max_region_cap' is
+ * smaller than 'opts->region_cap', if 'opts->alignment' is not a power of 2 or
+ * if the virtual memory backend was requested, but is not supported on this
+ * platform or reserving the address space failed.
+ *
+ * The virtual memory backend uses mmap() on POSIX systems and VirtualAlloc()
+ * on Windows. On POSIX systems, it requires MAP_ANONYMOUS - when compiling with
+ * '-std=c99', define _DEFAULT_SOURCE before including any system header. */
+
+sarena* sarena_create_with(const sarena_options* opts);
+
+/* -------------------------------------------------------------------------- */
+
 /* Destroys the arena. This will destroy every region inside the region list.
  * 'Destroying a region implies freeing the memory occupied by the region's
  * memory pool. This also frees the dynamically allocated memory to
@@ -84,6 +363,58 @@ void sarena_destroy(sarena* arena);
 
 /* -------------------------------------------------------------------------- */
 
+/* Creates an arena entirely inside the caller-provided buffer 'buf' of 'len'
+ * bytes: the arena object is placed at the start of the buffer, and the rest
+ * of it becomes the only region. No heap memory is ever allocated, so once the
+ * buffer is full, allocations fail. The arena is destroyed with
+ * sarena_destroy(), which leaves the buffer itself to the caller.
+ *
+ * Return value:
+ * ON SUCCESS: address of the arena, which lies inside 'buf';
+ * ON FAILURE: NULL. This can occur if 'buf' is NULL or if 'len' is too small
+ * to hold the arena object and a region. */
+
+sarena* sarena_init_in_buffer(void* buf, size_t len);
+
+/* -------------------------------------------------------------------------- */
+
+/* A region cache keeps the regions freed by arenas on destroy and reset, and
+ * hands them out to arenas needing a region of matching capacity, so the
+ * pattern of repeatedly creating, filling and destroying short-lived arenas
+ * does not go through malloc() and free(). A region is considered a match if
+ * its capacity is at least the requested one, but less than twice as large.
+ *
+ * The cache holds at most 'retain_cap' bytes - regions freed while the cache
+ * is full are freed as usual. Regions backed by huge pages, bound to a NUMA
+ * node or belonging to the virtual memory backend are never cached.
+ *
+ * A cache may be shared by any number of arenas and threads.
+ *
+ * Return value:
+ * ON SUCCESS: address of the newly-allocated cache;
+ * ON FAILURE: NULL. This can occur if the malloc for the cache fails. */
+
+sarena_region_cache* sarena_region_cache_create(size_t retain_cap);
+
+/* Frees all regions held by the cache and the cache itself. Must not be called
+ * while an arena using the cache still exists. */
+
+void sarena_region_cache_destroy(sarena_region_cache* cache);
+
+/* Changes the retention limit of the cache. Cached regions exceeding the new
+ * limit are freed, so a limit of 0 empties the cache. */
+
+void sarena_region_cache_set_retain(sarena_region_cache* cache,
+        size_t retain_cap);
+
+/* Returns the process-wide region cache. It exists for the lifetime of the
+ * process and has a retention limit of 0, so it caches nothing until the
+ * limit is raised with sarena_region_cache_set_retain(). */
+
+sarena_region_cache* sarena_region_cache_global(void);
+
+/* -------------------------------------------------------------------------- */
+
 /* This function allocates memory within the arena. It finds the currently active
  * region in the list and attempts to allocate the requested memory size within
  * its internal memory pool. 'Currently active region' refers to:
@@ -96,321 +427,4897 @@ void sarena_destroy(sarena* arena);
  * memory pool. If that region does not have enough space, the next region will
  * be considered. 
  *
+ * In both cases, before moving on from the active region, the arena tries the
+ * previously active region with the most free space left, so the tail space of
+ * abandoned regions is reused by smaller allocations.
+ *
+ * Allocations larger than 'region_cap' are placed inside a dedicated region
+ * of matching size, which is inserted after the currently active region. Such
+ * regions are kept on rewind, and reused by any allocation they can fit. 
+ *
  * Return value:
  * ON SUCCESS: address of the newly-allocated memory inside the arena
  * of 'size' bytes. If 'sizxe' is 0, NULL is returned;
  * ON FAILURE: NULL. This can occur if the arena had to allocate a new region
- * of memory via malloc(), and the allocation failed. */
+ * of memory via malloc(), and the allocation failed.
+ *
+ * This function is defined inline. When the active region has enough space,
+ * it performs the allocation without calling into the library. Otherwise, it
+ * calls sarena_malloc_slow(). */
+
+void* sarena_malloc_slow(sarena* arena, size_t size);
+
+static inline void* sarena_malloc(sarena* arena, size_t size)
+{
+    sa_hot* hot = (sa_hot*)arena;
+
+    if((arena != NULL) && (hot->_slow == 0) && (size != 0))
+    {
+        sa_region* region = hot->_curr;
+        size_t mask = hot->_alignment - 1;
+
+        // region pools are aligned to the arena's alignment
+        size_t offset = (region->_used_cap + mask) & ~mask;
+
+        if((offset <= region->_fast_cap) &&
+                (size <= region->_fast_cap - offset))
+        {
+            hot->_waste += offset - region->_used_cap;
+            region->_used_cap = offset + size;
+#ifdef SARENA_STATS
+            hot->_alloc_count++;
+#endif
+
+            return region->_mem_pool + offset;
+        }
+    }
+
+    return sarena_malloc_slow(arena, size);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* If SARENA_DEBUG is defined, when building the library as well as when
+ * including this header, arenas check the memory they hand out:
+ *
+ * 1) every allocation is followed by a redzone of SARENA_DEBUG_REDZONE bytes
+ *    and preceded by a small header, both filled with a known pattern. The
+ *    pattern is checked when the allocation is released by a rewind, reset
+ *    or destroy, and the program is aborted with a report naming the code
+ *    address of the call site if an overflow or underflow is detected;
+ * 2) released memory is filled with a pattern, so reads of stale data stand
+ *    out;
+ * 3) when built with AddressSanitizer, unused and released memory, headers
+ *    and redzones are poisoned, so invalid accesses are reported as they
+ *    happen. This includes the slots freed with sarena_pool_free().
+ *
+ * Allocations always take the out-of-line path, sarena_tls_malloc() and
+ * sarena_malloc_n() allocate every block separately, and blocks are never
+ * resized in place. */
+
+#ifndef SARENA_DEBUG_REDZONE
+#define SARENA_DEBUG_REDZONE 16
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+/* Behaves like sarena_malloc(), but the returned address will be a multiple
+ * of 'alignment', regardless of the arena's default alignment. Bytes skipped
+ * to satisfy the alignment are not reused until the arena is rewinded or
+ * reset.
+ *
+ * Return value:
+ * ON SUCCESS: address of the newly-allocated memory inside the arena
+ * of 'size' bytes. If 'size' is 0, NULL is returned;
+ * ON FAILURE: NULL. This can occur if 'alignment' is not a power of 2 or if
+ * the arena had to allocate a new region via malloc(), and the allocation
+ * failed. */
+
+void* sarena_malloc_aligned(sarena* arena, size_t size, size_t alignment);
+
+/* -------------------------------------------------------------------------- */
+
+/* This function allocates a zero-initialized memory block of the given size 
+ * from the SArena. It behaves similarly to sarena_malloc, but ensures that
+ * the allocated memory is filled with zeros.
+ *
+ * Each region tracks how much of its memory pool was ever used, and bytes
+ * beyond that are not cleared again if they are known to be zero. This holds
+ * for memory obtained with mmap() - regions backed by huge pages or bound to a
+ * NUMA node, and the virtual memory backend - and for regions zeroed by
+ * sarena_rewind_zero().
+
+The return value and possible errors are the same as those for sarena_malloc. */
+
+void* sarena_calloc(sarena* arena, size_t size);
+
+/* -------------------------------------------------------------------------- */
+
+/* Allocates a contiguous array of 'count' elements of 'elem_size' bytes each.
+ * The array is aligned to the arena's alignment.
+ *
+ * Return value:
+ * ON SUCCESS: address of the first element;
+ * ON FAILURE: NULL. This can occur if 'elem_size' or 'count' is 0, if the
+ * size of the array overflows 'size_t', or for the reasons listed for
+ * sarena_malloc(). */
+
+void* sarena_malloc_array(sarena* arena, size_t elem_size, size_t count);
+
+/* Allocates 'count' separate blocks of 'elem_size' bytes each, storing their
+ * addresses in 'out_ptrs'. Each block is aligned like a block returned by
+ * sarena_malloc(). Space for the whole batch is reserved at once: the blocks
+ * fill the rest of the active region, and the remaining ones are placed
+ * contiguously in a single other region, so the cost per block comes down to
+ * computing its address.
+ *
+ * Return value:
+ * The number of blocks allocated. This is 'count' on success, and less than
+ * that if allocating a new region failed. Only the first blocks of
+ * 'out_ptrs' are written then. */
+
+size_t sarena_malloc_n(sarena* arena, size_t elem_size, size_t count,
+        void** out_ptrs);
+
+/* -------------------------------------------------------------------------- */
+
+/* Resizes the block at 'ptr', which was allocated from the arena with a size
+ * of 'old_size' bytes, to 'new_size' bytes. If the block is the most recent
+ * allocation of its region and the region has enough space left, the block is
+ * resized in place. Otherwise, a new block is allocated and the contents of
+ * the old one are copied to it. Shrinking a block never moves it.
+ *
+ * If 'ptr' is NULL, this behaves like sarena_malloc(arena, new_size). If
+ * 'new_size' is 0, this behaves like sarena_free_last(arena, ptr, old_size)
+ * and returns NULL.
+ *
+ * Return value:
+ * ON SUCCESS: address of the resized block;
+ * ON FAILURE: NULL. The block at 'ptr' is left untouched. */
+
+void* sarena_realloc(sarena* arena, void* ptr, size_t old_size,
+        size_t new_size);
+
+/* Resizes the block at 'ptr' in place, as described for sarena_realloc().
+ *
+ * Return value:
+ * ON SUCCESS: 0;
+ * ON FAILURE: 1. This can occur if the block is not the most recent allocation
+ * of its region, or if the region does not have enough space left. */
+
+int sarena_grow(sarena* arena, void* ptr, size_t old_size, size_t new_size);
+
+/* If the block at 'ptr' of 'size' bytes is the most recent allocation of its
+ * region, its memory is made available for reuse. Otherwise, this function
+ * does nothing. */
+
+void sarena_free_last(sarena* arena, void* ptr, size_t size);
+
+/* -------------------------------------------------------------------------- */
+
+/* A pool of fixed-size slots carved out of an arena. Slots can be freed and
+ * reused individually, which suits objects with mixed lifetimes. Once the
+ * arena is rewinded or reset, all slots become invalid and the pool starts
+ * over, so a pool never has to be torn down. sarena_rewind_to() only
+ * invalidates the slots carved after the mark; the pool keeps reusing the
+ * others.
+ *
+ * A pool is not thread-safe - give each thread its own, they may share the
+ * arena if it is concurrent. The fields are private. */
+
+typedef struct sarena_pool
+{
+    sarena* _arena;
+    size_t _slot_size;
+    size_t _generation; // generation of the arena the slots belong to
+    size_t _releases; // releases of the arena the slots belong to
+
+    void* _free; // free list, linked through the first bytes of each slot
+
+    /* Unused part of the last chunk taken from the arena. */
+    char* _pos;
+    char* _end;
+} sarena_pool;
+
+/* Number of slots each chunk taken from the arena by a pool can hold. */
+
+#ifndef SARENA_POOL_BATCH
+#define SARENA_POOL_BATCH 64
+#endif
+
+/* Initializes 'pool' to hand out slots of 'slot_size' bytes from 'arena'.
+ * Slots are at least pointer-sized and aligned to the arena's alignment. No
+ * memory is allocated until the first call to sarena_pool_alloc().
+ *
+ * Return value:
+ * ON SUCCESS: 0;
+ * ON FAILURE: 1. This can occur if 'pool' or 'arena' is NULL, or if
+ * 'slot_size' is 0. */
+
+int sarena_pool_init(sarena_pool* pool, sarena* arena, size_t slot_size);
+
+/* Allocates a slot, reusing a freed one if possible. Otherwise, slots are
+ * taken from a chunk of SARENA_POOL_BATCH slots allocated from the arena.
+ *
+ * Return value:
+ * ON SUCCESS: address of the slot;
+ * ON FAILURE: NULL. This can occur if allocating a chunk from the arena
+ * failed. */
+
+void* sarena_pool_alloc(sarena_pool* pool);
+
+/* Returns the slot at 'ptr' to the pool. 'ptr' must have been returned by
+ * sarena_pool_alloc() of the same pool since the arena was last rewinded or
+ * reset, and must not have been released by sarena_rewind_to() since. */
+
+void sarena_pool_free(sarena_pool* pool, void* ptr);
+
+/* -------------------------------------------------------------------------- */
+
+/* Size of the chunks which sarena_tls_malloc() carves out of the shared arena.
+ * The actual chunk size is capped to a quarter of the arena's 'region_cap'. */
+
+#ifndef SARENA_TLS_CHUNK_SIZE
+#define SARENA_TLS_CHUNK_SIZE 16384
+#endif
+
+/* Number of arenas each thread can cache chunks for at the same time. */
+
+#ifndef SARENA_TLS_SLOTS
+#define SARENA_TLS_SLOTS 4
+#endif
+
+/* This function allocates memory within the arena through a cache private to
+ * the calling thread. The cache holds a chunk of SARENA_TLS_CHUNK_SIZE bytes
+ * carved out of the arena, and allocations are bump-allocated from it without
+ * any synchronization. When the chunk runs out, a new one is allocated from
+ * the arena. Allocations larger than a quarter of a chunk bypass the cache.
+ *
+ * If the arena is shared between threads, it must have been created with
+ * sarena_create_concurrent(). Rewinding or resetting the arena invalidates
+ * the chunks cached by all threads. The unused remainder of a chunk is lost
+ * until the arena is rewinded or reset.
+ *
+ * The returned address is aligned to the arena's alignment.
+ *
+ * The return value and possible errors are the same as those for
+ * sarena_malloc(). */
+
+void* sarena_tls_malloc(sarena* arena, size_t size);
+
+/* -------------------------------------------------------------------------- */
+
+/* This function resets the arena by marking all allocated memory within
+ * existing regions as available for reuse. It does not free any memory
+ * but instead sets all regions' used capacity to zero. 
+ * If multiple regions exist, the arena enters 'rewind mode' allowing
+ * previously allocated regions to be reused in order.
+ *
+ * Only the regions used since the last rewind are touched, so the cost of
+ * rewinding is proportional to usage rather than to the number of regions.
+ * Arenas with an epoch domain set these regions aside instead, see
+ * 'sarena_options.epoch'. */
+
+void sarena_rewind(sarena* arena);
+
+/* Rewinds the arena like sarena_rewind(), then zeroes all memory which was
+ * used, so that later calls to sarena_calloc() do not have to. Page-aligned
+ * parts of mmap()-backed regions are handed back to the OS instead of being
+ * written to (with MADV_DONTNEED), and large ranges of other regions are
+ * cleared with non-temporal stores where SSE2 is available, so the zeroes do
+ * not evict the cache. */
+
+void sarena_rewind_zero(sarena* arena);
+
+/* -------------------------------------------------------------------------- */
+
+/* This function deallocates all allocated regions except the first one.
+ * This means that all memory occupied by those regions will be freed.
+ * The first region will be reset, making its memory available for reuse.
+ * After this call, the arena will be in the same state as immediately
+ * after sarena_create(). This also restarts the growth of region sizes. */
+
+void sarena_reset(sarena* arena);
+
+/* -------------------------------------------------------------------------- */
+
+/* Frees the empty regions that are not needed to hold 'keep_cap' bytes.
+ * Regions holding allocations are never freed, and neither is the first
+ * region. Regions are kept in list order until their total capacity reaches
+ * 'keep_cap' bytes, including the region that crosses it, so a sarena_rewind()
+ * followed by a trim keeps warm capacity for the typical workload without
+ * keeping all the memory of a past spike.
+ *
+ * For arenas using the virtual memory backend, committed pages beyond
+ * 'keep_cap' bytes (rounded up to the commit granularity) are decommitted
+ * instead. Marks remain valid.
+ *
+ * Like sarena_rewind(), this must not be called while other threads allocate
+ * from the arena. */
+
+void sarena_trim(sarena* arena, size_t keep_cap);
+
+/* -------------------------------------------------------------------------- */
+
+/* A position inside an arena, obtained with sarena_mark(). */
+
+typedef struct sarena_mark_t
+{
+    void* _region;
+    size_t _used_cap;
+
+    void* _spares[SARENA_SPARE_MAX];
+    size_t _spare_used_caps[SARENA_SPARE_MAX];
+
+    void* _cleanup; // most recent cleanup callback, see sarena_on_reset()
+    void* _debug; // most recent allocation, only tracked if SARENA_DEBUG
+} sarena_mark_t;
+
+/* Records the current allocation position of the arena. Passing the returned
+ * mark to sarena_rewind_to() discards every allocation made after it.
+ *
+ * A mark becomes invalid once the arena is rewinded or reset, or rewinded to
+ * an earlier mark. Using an invalid mark is undefined behavior.
+ *
+ * Return value: the mark. Its '_region' is NULL if 'arena' is NULL. */
+
+sarena_mark_t sarena_mark(sarena* arena);
+
+/* -------------------------------------------------------------------------- */
+
+/* Rewinds the arena to 'mark', making the memory allocated after the mark
+ * available for reuse. Only the regions used after the mark are touched, and
+ * no memory is freed. Marks taken after 'mark' become invalid.
+ *
+ * Cleanup callbacks registered after the mark are run first.
+ *
+ * If 'mark._region' is NULL, this function does nothing. */
+
+void sarena_rewind_to(sarena* arena, sarena_mark_t mark);
+
+/* -------------------------------------------------------------------------- */
+
+typedef void (*sarena_cleanup_fn)(void* ctx);
+
+/* Registers 'fn' to be called with 'ctx' when the memory allocated up to now
+ * is released: on sarena_rewind(), sarena_reset() and sarena_destroy(), and on
+ * sarena_rewind_to() a mark taken before the registration. This allows objects
+ * owning resources, such as file descriptors, to live inside the arena.
+ *
+ * Callbacks run in the reverse order of their registration, before any memory
+ * is released, so they may still access memory of the arena. Each callback
+ * runs once. The bookkeeping is allocated from the arena itself.
+ *
+ * Return value:
+ * ON SUCCESS: 0;
+ * ON FAILURE: 1. This can occur if 'arena' or 'fn' is NULL, or if allocating
+ * the bookkeeping from the arena fails. 'fn' is not called in that case. */
+
+int sarena_on_reset(sarena* arena, sarena_cleanup_fn fn, void* ctx);
+
+/* -------------------------------------------------------------------------- */
+
+/* Usage statistics of an arena, filled in by sarena_stats(). */
+
+typedef struct sarena_stats_t
+{
+    /* Bytes currently allocated, including alignment padding. */
+    size_t used;
+
+    /* Total capacity of all regions. For arenas using the virtual memory
+     * backend, this is the number of committed bytes. */
+    size_t reserved;
+
+    size_t region_count;
+
+    /* Total capacity of the regions released by sarena_rewind() or
+     * sarena_reset() which are waiting for the readers of the arena's epoch
+     * domain, see 'sarena_options.epoch'. They are not part of 'reserved'. */
+    size_t deferred;
+
+    /* Highest value of 'used' since the arena was created or last reset. It
+     * is sampled whenever the arena is rewinded, reset or queried, so usage
+     * discarded by sarena_rewind_to() is only accounted for if SARENA_STATS
+     * is defined. */
+    size_t peak;
+
+    /* Number of allocations since the arena was created or last reset. Only
+     * counted if SARENA_STATS is defined, when building the library as well as
+     * when including this header - 0 otherwise. */
+    size_t alloc_count;
+
+    /* Bytes lost to alignment padding and to the unused tails of abandoned
+     * regions since the arena was last rewinded or reset. */
+    size_t waste;
+} sarena_stats_t;
+
+/* Fills 'out' with the usage statistics of the arena. This walks the region
+ * list, so it takes time proportional to the number of regions.
+ *
+ * For concurrent arenas, the statistics are only exact if no other thread is
+ * allocating from the arena at the same time. */
+
+void sarena_stats(sarena* arena, sarena_stats_t* out);
+
+/* -------------------------------------------------------------------------- */
+
+/* If SARENA_TRACE is defined, when building the library as well as when
+ * including this header, arenas report their activity to the trace callback
+ * set with sarena_set_trace(), and through USDT probes in provider 'sarena'
+ * if <sys/sdt.h> is available. The probes 'alloc', 'region', 'rewind' and
+ * 'reset' are passed the same arena, address and size as the callback.
+ * Allocations always take the out-of-line path.
+ *
+ * Allocations are reported as they are carved out of the arena, so blocks
+ * handed out by sarena_tls_malloc() and pools are reported per chunk. */
+
+enum sarena_trace_type
+{
+    SARENA_TRACE_ALLOC = 0, // 'ptr' and 'size' of a new block
+    SARENA_TRACE_REGION, // memory pool and capacity of a new region
+    SARENA_TRACE_REWIND, // 'size' bytes are released by any sarena_rewind*()
+    SARENA_TRACE_RESET // 'size' bytes are released by a reset
+};
+
+typedef struct sarena_trace_event
+{
+    int type; // one of 'enum sarena_trace_type'
+    sarena* arena;
+
+    void* ptr;
+    size_t size;
+
+    /* Code address the public function which caused the event returns to,
+     * which can be resolved with addr2line or a symbolizer. If the library
+     * is compiled into the caller's translation unit, the function may be
+     * inlined, and the address then belongs to the caller's caller. */
+    void* site;
+} sarena_trace_event;
+
+typedef void (*sarena_trace_fn)(void* ctx, const sarena_trace_event* event);
+
+/* Sets the process-wide trace callback, which is passed 'ctx' along with each
+ * event. Only every 'sample_period'-th allocation of each thread is reported,
+ * so a period of 1000 keeps the overhead negligible while the reported sizes
+ * still reflect where memory goes. A period of 0 or 1 reports all of them.
+ * Other events are never sampled. A NULL 'fn' disables the callback.
+ *
+ * Must not be called while other threads use arenas. Does nothing unless the
+ * library was built with SARENA_TRACE. */
+
+void sarena_set_trace(sarena_trace_fn fn, void* ctx, size_t sample_period);
+
+/* -------------------------------------------------------------------------- */
+
+/* A ring of arenas for pipelines in which one stage fills a batch while the
+ * next stage reads the previous one. The producer allocates from the current
+ * generation and publishes it with sarena_ring_advance(), which moves on to
+ * the oldest generation, rewinding it. Once every generation has been used,
+ * advancing allocates no memory.
+ *
+ * A consumer thread obtains the latest published generation with
+ * sarena_ring_acquire(), and gives it back with sarena_ring_release(). The
+ * producer cannot rewind a generation while it is acquired.
+ *
+ * Only one thread may act as the producer. Any number of threads may act as
+ * consumers. */
+
+/* Creates a ring of 'generations' arenas, each created by
+ * sarena_create_with() from 'opts'.
+ *
+ * Return value:
+ * ON SUCCESS: address of the newly-allocated ring;
+ * ON FAILURE: NULL. This can occur if 'generations' is smaller than 2, or if
+ * creating any of the arenas fails. */
+
+sarena_ring* sarena_ring_create(size_t generations, const sarena_options* opts);
+
+/* Destroys the ring and all of its arenas. No generation may be acquired. */
+
+void sarena_ring_destroy(sarena_ring* ring);
+
+/* Returns the arena of the generation the producer is currently filling. */
+
+sarena* sarena_ring_current(sarena_ring* ring);
+
+/* Publishes the current generation, with release semantics, and makes the
+ * generation after it current. Generations are numbered from 1, so the
+ * current generation after 'n' calls is 'n + 1'.
+ *
+ * The new current generation is the oldest one, and is rewinded, discarding
+ * all allocations made when it was last filled, so the ring holds the last
+ * 'generations - 1' published generations.
+ *
+ * Return value:
+ * ON SUCCESS: arena of the new current generation;
+ * ON FAILURE: NULL, if the oldest generation is still acquired by a consumer.
+ * Nothing is published then, and the producer may retry later. */
+
+sarena* sarena_ring_advance(sarena_ring* ring);
+
+/* Acquires the most recently published generation, with acquire semantics,
+ * so everything the producer wrote into it before publishing is visible. The
+ * generation is not rewinded until it is released with sarena_ring_release().
+ * Its number is stored in '*generation'.
+ *
+ * Return value:
+ * ON SUCCESS: arena of the acquired generation;
+ * ON FAILURE: NULL, if nothing has been published yet. */
+
+sarena* sarena_ring_acquire(sarena_ring* ring, size_t* generation);
+
+/* Releases a generation acquired with sarena_ring_acquire(). */
+
+void sarena_ring_release(sarena_ring* ring, size_t generation);
+
+/* -------------------------------------------------------------------------- */
+
+/* An epoch domain lets other threads read structures allocated from arenas
+ * while a single thread keeps allocating from them, rewinding and resetting
+ * them. Each reader registers with the domain, and wraps its accesses in
+ * sarena_epoch_enter() and sarena_epoch_exit(). The arenas created with the
+ * domain in 'sarena_options.epoch' then set the regions released by
+ * sarena_rewind() and sarena_reset() aside, allocating from other regions,
+ * and take them back once every reader which was inside a section at the
+ * time has left it. The readers never wait, and neither does the writer
+ * unless allocating a region to replace the ones set aside fails: it then
+ * waits for the readers to leave so it can reuse them.
+ *
+ * Before rewinding, the writer must unlink the structures it releases from
+ * wherever readers find them, so readers entering afterwards cannot reach
+ * them. Cleanup callbacks registered with sarena_on_reset() run when the
+ * regions are taken back. sarena_rewind_to() is not deferred, so it must not
+ * release memory readers may still use. */
+
+/* Creates an epoch domain with room for 'max_readers' registered readers.
+ *
+ * Return value:
+ * ON SUCCESS: address of the newly-allocated domain;
+ * ON FAILURE: NULL. */
+
+sarena_epoch* sarena_epoch_create(size_t max_readers);
+
+/* Destroys the domain. The arenas using it must be destroyed first. */
+
+void sarena_epoch_destroy(sarena_epoch* epoch);
+
+/* Registers a reader, storing its ID in '*reader'. Every thread reading
+ * concurrently needs its own ID.
+ *
+ * Return value:
+ * ON SUCCESS: 0;
+ * ON FAILURE: 1, if all 'max_readers' IDs are taken. */
+
+int sarena_epoch_register(sarena_epoch* epoch, size_t* reader);
+
+/* Gives back the ID of a reader, which must be outside of a section. */
+
+void sarena_epoch_unregister(sarena_epoch* epoch, size_t reader);
+
+/* Enters a section, in which the memory of the arenas using the domain stays
+ * valid until the matching sarena_epoch_exit(). This is a store to a cache
+ * line private to the reader followed by a full memory fence. Sections must
+ * not be nested. */
+
+void sarena_epoch_enter(sarena_epoch* epoch, size_t reader);
+
+/* Leaves the section, with release semantics. */
+
+void sarena_epoch_exit(sarena_epoch* epoch, size_t reader);
+
+/* -------------------------------------------------------------------------- */
+
+/* Snapshots store the contents of an arena in a file, which can later be
+ * mapped read-only with sarena_map() instead of being rebuilt. Since the
+ * regions of the arena are laid out differently in the file, pointers stored
+ * inside the arena do not survive - data structures saved this way should
+ * link their objects with offsets obtained from sarena_off().
+ *
+ * An offset identifies a region of the arena and a position inside it, so it
+ * stays valid as the arena grows, until the arena is rewinded or reset. It
+ * remains valid in any image saved from the arena. 0 is never a valid offset.
+ *
+ * Images contain raw memory, so they are only portable between builds with
+ * the same data layout. Snapshots are only supported on POSIX systems. */
+
+typedef uint64_t sarena_off_t;
+
+#define SARENA_OFF_NULL ((sarena_off_t)0)
+
+/* Return value:
+ * ON SUCCESS: offset of 'ptr', which must point inside the arena;
+ * ON FAILURE: SARENA_OFF_NULL. This can occur if 'ptr' does not belong to
+ * the arena, or if it lies further than 2^40 bytes into its region.
+ *
+ * This takes time proportional to the number of regions. */
+
+sarena_off_t sarena_off(sarena* arena, const void* ptr);
+
+/* Return value:
+ * ON SUCCESS: the address in the arena corresponding to 'off';
+ * ON FAILURE: NULL. This can occur if 'off' is SARENA_OFF_NULL or does not
+ * belong to the arena.
+ *
+ * This takes time proportional to the number of regions. */
+
+void* sarena_off_ptr(sarena* arena, sarena_off_t off);
+
+/* Writes the used part of every region of the arena to 'fd' as one image,
+ * along with 'root' - usually the offset of the object from which all the
+ * other saved objects are reachable. Alignments of up to 64 bytes are
+ * preserved in the image. Other threads must not allocate from the arena
+ * meanwhile.
+ *
+ * Return value:
+ * ON SUCCESS: 0;
+ * ON FAILURE: 1. This can occur if 'arena' is NULL, if writing to 'fd' fails
+ * or if snapshots are not supported on this platform. Part of the image may
+ * have been written. */
+
+int sarena_save(sarena* arena, int fd, sarena_off_t root);
+
+/* Maps the image stored in the file at 'path' read-only. Nothing is copied -
+ * pages are read from the file on first access.
+ *
+ * Return value:
+ * ON SUCCESS: the mapped image;
+ * ON FAILURE: NULL. This can occur if the file cannot be opened or mapped, if
+ * it is not a valid image or if snapshots are not supported on this
+ * platform. */
+
+sarena_image* sarena_map(const char* path);
+
+/* Unmaps the image. All addresses obtained from it become invalid. */
+
+void sarena_unmap(sarena_image* image);
+
+/* Return value: the root offset passed to sarena_save(). */
+
+sarena_off_t sarena_image_root(const sarena_image* image);
+
+/* Return value:
+ * ON SUCCESS: the address in the image corresponding to 'off';
+ * ON FAILURE: NULL. This can occur if 'off' is SARENA_OFF_NULL or does not
+ * belong to the image. */
+
+const void* sarena_image_ptr(const sarena_image* image, sarena_off_t off);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SARENA_H_
+
+/* -------------------------------------------------------------------------- */
+/* IMPLEMENTATION */
+/* -------------------------------------------------------------------------- */
+
+#ifdef SARENA_IMPLEMENTATION
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Alignment guaranteed by malloc() on all supported platforms. Regions of
+ * arenas with a larger alignment over-allocate their memory pools. */
+#define _SA_MALLOC_ALIGNMENT (2 * sizeof(void*))
+
+#define _sa_is_pow2(x) (((x) != 0) && (((x) & ((x) - 1)) == 0))
+#define _sa_align_up(x, a) (((x) + ((a) - 1)) & ~((uintptr_t)(a) - 1))
+
+/* -------------------------------------------------------------------------- */
+/* VIRTUAL MEMORY */
+/* -------------------------------------------------------------------------- */
+
+#if defined(_WIN32)
+
+#include <windows.h>
+#define _SA_HAVE_VM 1
+
+#elif defined(__unix__) || defined(__APPLE__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifdef MAP_ANONYMOUS
+#define _SA_HAVE_VM 1
+#endif
+
+#endif
+
+#ifndef _SA_HAVE_VM
+#define _SA_HAVE_VM 0
+#endif
+
+static size_t _sa_vm_page_size(void);
+static void* _sa_vm_reserve(size_t size);
+static void* _sa_vm_reserve_aligned(size_t size, size_t alignment);
+static int _sa_vm_commit(void* addr, size_t size);
+static void _sa_vm_decommit(void* addr, size_t size);
+static void _sa_vm_release(void* addr, size_t size);
+
+#if _SA_HAVE_VM && defined(_WIN32)
+
+static size_t _sa_vm_page_size(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return info.dwPageSize;
+}
+
+static void* _sa_vm_reserve(size_t size)
+{
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+static void* _sa_vm_reserve_aligned(size_t size, size_t alignment)
+{
+    (void)alignment; // huge pages are not supported, page alignment suffices
+    return _sa_vm_reserve(size);
+}
+
+static int _sa_vm_commit(void* addr, size_t size)
+{
+    return (VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE) != NULL) ?
+        0 : 1;
+}
+
+static void _sa_vm_decommit(void* addr, size_t size)
+{
+    VirtualFree(addr, size, MEM_DECOMMIT);
+}
+
+static void _sa_vm_release(void* addr, size_t size)
+{
+    (void)size;
+    VirtualFree(addr, 0, MEM_RELEASE);
+}
+
+#elif _SA_HAVE_VM
+
+static size_t _sa_vm_page_size(void)
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void* _sa_vm_reserve(size_t size)
+{
+    void* addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0);
+
+    return (addr != MAP_FAILED) ? addr : NULL;
+}
+
+/* Over-reserves by 'alignment' and unmaps the unaligned head and tail. */
+static void* _sa_vm_reserve_aligned(size_t size, size_t alignment)
+{
+    size_t page_size = _sa_vm_page_size();
+
+    if(alignment <= page_size) return _sa_vm_reserve(size);
+    if(size > SIZE_MAX - alignment) return NULL;
+
+    char* addr = (char*)_sa_vm_reserve(size + alignment);
+    if(addr == NULL) return NULL;
+
+    char* aligned = (char*)_sa_align_up((uintptr_t)addr, alignment);
+
+    if(aligned > addr)
+        munmap(addr, (size_t)(aligned - addr));
+    munmap(aligned + size, (size_t)(addr + alignment - aligned));
+
+    return aligned;
+}
+
+static int _sa_vm_commit(void* addr, size_t size)
+{
+    return (mprotect(addr, size, PROT_READ | PROT_WRITE) == 0) ? 0 : 1;
+}
+
+static void _sa_vm_decommit(void* addr, size_t size)
+{
+#ifdef MADV_DONTNEED
+    madvise(addr, size, MADV_DONTNEED);
+    mprotect(addr, size, PROT_NONE);
+#else
+    // replacing the pages hands them back to the OS
+    mmap(addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+#endif
+}
+
+static void _sa_vm_release(void* addr, size_t size)
+{
+    munmap(addr, size);
+}
+
+#else
+
+static size_t _sa_vm_page_size(void) { return 0; }
+static void* _sa_vm_reserve(size_t size) { (void)size; return NULL; }
+static void* _sa_vm_reserve_aligned(size_t size, size_t alignment)
+{ (void)alignment; return _sa_vm_reserve(size); }
+static int _sa_vm_commit(void* addr, size_t size)
+{ (void)addr; (void)size; return 1; }
+static void _sa_vm_decommit(void* addr, size_t size)
+{ (void)addr; (void)size; }
+static void _sa_vm_release(void* addr, size_t size)
+{ (void)addr; (void)size; }
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+/* FILES */
+/* -------------------------------------------------------------------------- */
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_WIN32)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define _SA_HAVE_FILES 1
+
+#else
+
+#define _SA_HAVE_FILES 0
+
+#endif
+
+static int _sa_file_write(int fd, const void* buf, size_t size);
+static int _sa_file_write_zeros(int fd, size_t size);
+static void* _sa_file_map(const char* path, size_t* size);
+static void _sa_file_unmap(void* addr, size_t size);
+
+#if _SA_HAVE_FILES
+
+/* Return value:
+ * ON SUCCESS: 0;
+ * ON FAILURE: 1. */
+static int _sa_file_write(int fd, const void* buf, size_t size)
+{
+    const char* it = (const char*)buf;
+
+    while(size > 0)
+    {
+        ssize_t written = write(fd, it, size);
+
+        if(written < 0)
+        {
+            if(errno == EINTR) continue;
+            return 1;
+        }
+
+        it += written;
+        size -= (size_t)written;
+    }
+
+    return 0;
+}
+
+static int _sa_file_write_zeros(int fd, size_t size)
+{
+    static const char zeros[64];
+
+    while(size > 0)
+    {
+        size_t chunk = (size < sizeof(zeros)) ? size : sizeof(zeros);
+
+        if(_sa_file_write(fd, zeros, chunk) != 0)
+            return 1;
+
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+/* Maps the whole file at 'path' read-only, storing its size in '*size'.
+ * Returns NULL on failure. */
+static void* _sa_file_map(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    void* addr = NULL;
+    struct stat st;
+
+    if((fstat(fd, &st) == 0) && (st.st_size > 0) &&
+            ((uintmax_t)st.st_size <= SIZE_MAX))
+    {
+        addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if(addr == MAP_FAILED)
+            addr = NULL;
+        else
+            *size = (size_t)st.st_size;
+    }
+
+    close(fd);
+
+    return addr;
+}
+
+static void _sa_file_unmap(void* addr, size_t size)
+{
+    munmap(addr, size);
+}
+
+#else
+
+static int _sa_file_write(int fd, const void* buf, size_t size)
+{ (void)fd; (void)buf; (void)size; return 1; }
+static int _sa_file_write_zeros(int fd, size_t size)
+{ (void)fd; (void)size; return 1; }
+static void* _sa_file_map(const char* path, size_t* size)
+{ (void)path; (void)size; return NULL; }
+static void _sa_file_unmap(void* addr, size_t size)
+{ (void)addr; (void)size; }
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+/* THREADS */
+/* -------------------------------------------------------------------------- */
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_WIN32)
+
+#include <pthread.h>
+
+#define _SA_HAVE_THREADS 1
+
+#else
+
+#define _SA_HAVE_THREADS 0
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+/* DEBUG MODE */
+/* -------------------------------------------------------------------------- */
+
+#ifdef SARENA_DEBUG
+
+#include <stdio.h>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define _SA_HAVE_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define _SA_HAVE_ASAN 1
+#endif
+#endif
+
+#endif // SARENA_DEBUG
+
+#ifdef _SA_HAVE_ASAN
+#include <sanitizer/asan_interface.h>
+#define _sa_poison(addr, size) ASAN_POISON_MEMORY_REGION((addr), (size))
+#define _sa_unpoison(addr, size) ASAN_UNPOISON_MEMORY_REGION((addr), (size))
+#else
+#define _sa_poison(addr, size) ((void)(addr), (void)(size))
+#define _sa_unpoison(addr, size) ((void)(addr), (void)(size))
+#endif
+
+#define _SA_DEBUG_REDZONE_BYTE 0xfd
+#define _SA_DEBUG_FREED_BYTE 0xdd
+#define _SA_DEBUG_CANARY ((uintptr_t)0x5a5a5a5a5a5a5a5aULL)
+
+/* Records the code address the current public function returns to as the
+ * call site of the allocations it makes, for debug mode and tracing. */
+#if defined(SARENA_DEBUG) || defined(SARENA_TRACE)
+static __thread void* _sa_call_site;
+#define _SA_CALL_SITE() (_sa_call_site = __builtin_return_address(0))
+#else
+#define _SA_CALL_SITE() ((void)0)
+#endif
+
+/* -------------------------------------------------------------------------- */
+/* TRACING */
+/* -------------------------------------------------------------------------- */
+
+#ifdef SARENA_TRACE
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define _SA_HAVE_SDT 1
+#endif
+#endif
+
+static sarena_trace_fn _sa_trace_fn;
+static void* _sa_trace_ctx;
+static size_t _sa_trace_period;
+
+static __thread size_t _sa_trace_countdown; // allocations until the next sample
+
+/* Passes the event to the trace callback, sampling allocations. */
+static void _sa_trace(sarena* arena, int type, void* ptr, size_t size)
+{
+    if(_sa_trace_fn == NULL) return;
+
+    if((type == SARENA_TRACE_ALLOC) && (_sa_trace_period > 1))
+    {
+        if(_sa_trace_countdown > 1)
+        {
+            _sa_trace_countdown--;
+            return;
+        }
+
+        _sa_trace_countdown = _sa_trace_period;
+    }
+
+    sarena_trace_event event = { type, arena, ptr, size, _sa_call_site };
+    _sa_trace_fn(_sa_trace_ctx, &event);
+}
+
+#endif // SARENA_TRACE
+
+/* USDT probes, see SARENA_TRACE. */
+#ifdef _SA_HAVE_SDT
+#define _SA_PROBE(name, a, b, c) DTRACE_PROBE3(sarena, name, (a), (b), (c))
+#else
+#define _SA_PROBE(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
+/* Reports an event of 'type' to the probe 'name' and the trace callback. */
+#ifdef SARENA_TRACE
+#define _SA_TRACE(arena, type, name, ptr, size)                                \
+    do {                                                                       \
+        _SA_PROBE(name, (arena), (ptr), (size));                               \
+        _sa_trace((arena), (type), (ptr), (size));                             \
+    } while(0)
+#else
+#define _SA_TRACE(arena, type, name, ptr, size) ((void)0)
+#endif
+
+/* -------------------------------------------------------------------------- */
+/* HUGE PAGES AND NUMA */
+/* -------------------------------------------------------------------------- */
+
+#if defined(__linux__) && _SA_HAVE_VM
+#include <sys/syscall.h>
+#define _SA_HAVE_LINUX_VM 1
+#else
+#define _SA_HAVE_LINUX_VM 0
+#endif
+
+#define _SA_NUMA_MAX_NODES 1024
+#define _SA_MPOL_BIND 2
+
+static size_t _sa_huge_page_size(int huge_pages);
+static int _sa_numa_local_node(void);
+static void _sa_pages_advise(void* addr, size_t size, int huge_pages,
+        int numa_node);
+static void* _sa_pages_alloc(size_t size, int huge_pages, int numa_node,
+        size_t* block_size);
+
+static size_t _sa_huge_page_size(int huge_pages)
+{
+#if _SA_HAVE_LINUX_VM
+    switch(huge_pages)
+    {
+        case SARENA_HUGE_PAGES_TRANSPARENT:
+        case SARENA_HUGE_PAGES_2MB:
+            return (size_t)1 << 21;
+        case SARENA_HUGE_PAGES_1GB:
+            return (size_t)1 << 30;
+    }
+#endif
+    (void)huge_pages;
+    return 0;
+}
+
+/* Returns the NUMA node of the calling thread, or -1 if it is unknown. */
+static int _sa_numa_local_node(void)
+{
+#if _SA_HAVE_LINUX_VM && defined(SYS_getcpu)
+    unsigned int cpu, node;
+
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return (int)node;
+#endif
+    return -1;
+}
+
+/* Applies the huge page and NUMA policies to a range of pages which was not
+ * touched yet. Both are hints - failures are ignored. */
+static void _sa_pages_advise(void* addr, size_t size, int huge_pages,
+        int numa_node)
+{
+#if _SA_HAVE_LINUX_VM
+#ifdef MADV_HUGEPAGE
+    if(huge_pages != SARENA_HUGE_PAGES_NONE)
+        madvise(addr, size, MADV_HUGEPAGE);
+#endif
+#ifdef SYS_mbind
+    if((numa_node >= 0) && (numa_node < _SA_NUMA_MAX_NODES))
+    {
+        const size_t bits = 8 * sizeof(unsigned long);
+        unsigned long mask[_SA_NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+
+        memset(mask, 0, sizeof(mask));
+        mask[numa_node / bits] |= 1UL << (numa_node % bits);
+
+        syscall(SYS_mbind, addr, size, _SA_MPOL_BIND, mask,
+                (unsigned long)_SA_NUMA_MAX_NODES + 1, 0);
+    }
+#endif
+#endif
+    (void)addr; (void)size; (void)huge_pages; (void)numa_node;
+}
+
+/* Maps 'size' bytes of committed memory, rounded up to the page size (or the
+ * huge page size). The final size is stored in 'block_size'. The memory must
+ * be freed with _sa_vm_release(). */
+static void* _sa_pages_alloc(size_t size, int huge_pages, int numa_node,
+        size_t* block_size)
+{
+    size_t huge_page_size = _sa_huge_page_size(huge_pages);
+    size_t page_size = (huge_page_size != 0) ?
+        huge_page_size : _sa_vm_page_size();
+
+    if((page_size == 0) || (size > SIZE_MAX - page_size)) return NULL;
+
+    size = _sa_align_up(size, page_size);
+
+#if _SA_HAVE_LINUX_VM && defined(MAP_HUGETLB)
+    if((huge_pages == SARENA_HUGE_PAGES_2MB) ||
+            (huge_pages == SARENA_HUGE_PAGES_1GB))
+    {
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+        int shift = (huge_pages == SARENA_HUGE_PAGES_2MB) ? 21 : 30;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+            (shift << MAP_HUGE_SHIFT);
+
+        void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+        if(addr != MAP_FAILED)
+        {
+            _sa_pages_advise(addr, size, SARENA_HUGE_PAGES_NONE, numa_node);
+            *block_size = size;
+            return addr;
+        }
+    }
+#endif
+
+    void* addr = _sa_vm_reserve_aligned(size, page_size);
+    if(addr == NULL) return NULL;
+
+    _sa_pages_advise(addr, size, huge_pages, numa_node);
+
+    if(_sa_vm_commit(addr, size) != 0)
+    {
+        _sa_vm_release(addr, size);
+        return NULL;
+    }
+
+    *block_size = size;
+    return addr;
+}
+
+/* -------------------------------------------------------------------------- */
+/* ZEROING */
+/* -------------------------------------------------------------------------- */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Ranges at least this large are cleared with non-temporal stores. */
+#define _SA_STREAM_THRESHOLD ((size_t)256 << 10)
+
+static void _sa_zero(void* ptr, size_t size);
+static void _sa_pages_zero(void* ptr, size_t size);
+
+static void _sa_zero(void* ptr, size_t size)
+{
+#if defined(__SSE2__)
+    if(size >= _SA_STREAM_THRESHOLD)
+    {
+        char* it = (char*)ptr;
+        size_t head = (size_t)(_sa_align_up((uintptr_t)it, 16) - (uintptr_t)it);
+
+        memset(it, 0, head);
+        it += head;
+        size -= head;
+
+        __m128i zero = _mm_setzero_si128();
+
+        for(; size >= 64; size -= 64, it += 64)
+        {
+            _mm_stream_si128((__m128i*)it, zero);
+            _mm_stream_si128((__m128i*)(it + 16), zero);
+            _mm_stream_si128((__m128i*)(it + 32), zero);
+            _mm_stream_si128((__m128i*)(it + 48), zero);
+        }
+
+        _mm_sfence();
+        memset(it, 0, size);
+
+        return;
+    }
+#endif
+    memset(ptr, 0, size);
+}
+
+/* Zeroes memory obtained with mmap(). Whole pages are dropped, and read back
+ * as zero on the next access. */
+static void _sa_pages_zero(void* ptr, size_t size)
+{
+#if _SA_HAVE_VM && !defined(_WIN32) && defined(MADV_DONTNEED)
+    size_t page_size = _sa_vm_page_size();
+    uintptr_t start = _sa_align_up((uintptr_t)ptr, page_size);
+    uintptr_t end = ((uintptr_t)ptr + size) & ~((uintptr_t)page_size - 1);
+
+    if((end > start) && (end - start >= _SA_STREAM_THRESHOLD) &&
+            (madvise((void*)start, end - start, MADV_DONTNEED) == 0))
+    {
+        memset(ptr, 0, (size_t)(start - (uintptr_t)ptr));
+        memset((void*)end, 0, (size_t)((uintptr_t)ptr + size - end));
+        return;
+    }
+#endif
+    _sa_zero(ptr, size);
+}
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct sa_region_list sa_region_list;
+
+typedef struct sa_backing sa_backing;
+
+/* Describes how the memory of an arena's regions is obtained. */
+
+struct sa_backing
+{
+    size_t _alignment;
+
+    int _huge_pages;
+    int _numa_node; // -1 if region memory is not bound to a node
+
+    sarena_region_cache* _cache; // NULL if regions are not recycled
+
+    sarena_allocator _allocator; // 'alloc' is NULL for malloc()
+};
+
+/* Where the block of memory holding a region comes from. */
+
+#define _SA_REGION_MALLOC 0
+#define _SA_REGION_PAGES 1 // mapped by _sa_pages_alloc()
+#define _SA_REGION_VM 2 // part of the reserved range of a VM arena
+#define _SA_REGION_BUFFER 3 // part of the buffer of sarena_init_in_buffer()
+
+#define _SA_REGION_HEADER_SIZE offsetof(sa_region, _mem_pool)
+
+static void* _sa_backing_alloc(const sa_backing* backing, size_t size);
+static void _sa_backing_free(const sa_backing* backing, void* ptr, size_t size);
+static sa_region* _sa_region_alloc(size_t total_cap, const sa_backing* backing);
+static void _sa_region_destroy(sa_region* region, const sa_backing* backing);
+static void _sa_region_mark_dirty(sa_region* region);
+static void _sa_region_zero(sa_region* region);
+static size_t _sa_region_used(const sa_region* region);
+static void _sa_region_rewind(sa_region* region, size_t used_cap);
+static void _sa_region_prefault(sa_region* region);
+static void _sa_region_prefetch(const sa_region* region);
+static inline size_t _sa_region_aligned_offset(const sa_region* region,
+        size_t alignment);
+static inline int _sa_region_fits(const sa_region* region, size_t offset,
+        size_t size);
+
+/* -------------------------------------------------------------------------- */
+
+struct sa_region_list
+{
+    sa_region* _head;
+    sa_region* _tail;
+
+    size_t _count;
+};
+
+static void _sa_region_list_init(sa_region_list* list);
+static int _sa_region_list_push_back(sa_region_list* list, size_t total_cap,
+        const sa_backing* backing);
+static int _sa_region_list_insert_after(sa_region_list* list, sa_region* pos,
+        size_t total_cap, const sa_backing* backing);
+static void _sa_region_list_link_after(sa_region_list* list, sa_region* pos,
+        sa_region* region);
+static void _sa_region_list_pop_front(sa_region_list* list,
+        const sa_backing* backing);
+static void _sa_region_list_truncate(sa_region_list* list, sa_region* pos,
+        const sa_backing* backing);
+static void _sa_region_list_erase_after(sa_region_list* list, sa_region* pos,
+        const sa_backing* backing);
+
+/* -------------------------------------------------------------------------- */
+
+/* Number of size bins of a region cache. Bin 'i' holds the regions with a
+ * capacity in [2^i, 2^(i+1)). */
+#define _SA_CACHE_BINS (sizeof(size_t) * 8)
+
+struct sarena_region_cache
+{
+    char _lock; // spinlock, see _sa_region_cache_lock()
+
+    size_t _retain_cap;
+    size_t _cached_cap; // sum of the block sizes of all cached objects
+
+    sa_region* _bins[_SA_CACHE_BINS];
+
+    /* Recycled arena objects, linked through their first bytes. */
+    void* _arenas;
+};
+
+static void _sa_region_cache_lock(sarena_region_cache* cache);
+static void _sa_region_cache_unlock(sarena_region_cache* cache);
+static size_t _sa_region_cache_bin(size_t total_cap);
+static sa_region* _sa_region_cache_take(sarena_region_cache* cache,
+        size_t total_cap, size_t alignment);
+static int _sa_region_cache_put(sarena_region_cache* cache, sa_region* region);
+static void* _sa_region_cache_take_arena(sarena_region_cache* cache);
+static int _sa_region_cache_put_arena(sarena_region_cache* cache, void* arena);
+static void _sa_region_cache_shrink(sarena_region_cache* cache);
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct sa_ring_slot sa_ring_slot;
+
+struct sa_ring_slot
+{
+    sarena* _arena;
+    size_t _generation; // generation the arena currently holds
+
+    /* Number of consumers holding the generation, or -1 while the producer
+     * rewinds it. */
+    int _readers;
+};
+
+struct sarena_ring
+{
+    size_t _count;
+    size_t _current; // generation being filled by the producer
+    size_t _published; // most recently published generation, 0 if none
+
+    sa_ring_slot _slots[]; // generation 'g' lives in '_slots[g % _count]'
+};
+
+static int _sa_ring_slot_lock(sa_ring_slot* slot);
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct sa_prefetcher sa_prefetcher;
+
+#if _SA_HAVE_THREADS
+
+/* Background thread preparing the next region of an arena, see
+ * 'sarena_options.prefetch_thread'. It holds at most one region at a time. */
+
+struct sa_prefetcher
+{
+    pthread_t _thread;
+    pthread_mutex_t _lock;
+    pthread_cond_t _wake;
+
+    const sa_backing* _backing;
+
+    size_t _request; // capacity of the region being prepared, 0 if none
+    sa_region* _ready; // prepared region, NULL if none
+    size_t _ready_cap; // capacity '_ready' was requested with
+    int _discard; // whether the region being prepared is no longer wanted
+    int _stop;
+};
+
+#endif // _SA_HAVE_THREADS
+
+static sa_prefetcher* _sa_prefetcher_create(const sa_backing* backing);
+static void _sa_prefetcher_destroy(sa_prefetcher* prefetcher);
+static void _sa_prefetcher_request(sa_prefetcher* prefetcher, size_t cap);
+static sa_region* _sa_prefetcher_take(sa_prefetcher* prefetcher, size_t size,
+        size_t alignment, size_t* cap);
+static void _sa_prefetcher_cancel(sa_prefetcher* prefetcher);
+
+/* -------------------------------------------------------------------------- */
+
+/* Layout of a snapshot image: a header, followed by one '_sa_image_region'
+ * per region of the saved arena, followed by the contents of the regions.
+ * The contents of each region are placed at a file offset congruent to the
+ * address of its memory pool modulo _SA_IMAGE_ALIGNMENT, which preserves the
+ * alignment of the allocations once the image is mapped. */
+
+#define _SA_IMAGE_MAGIC "SARENA01"
+#define _SA_IMAGE_ALIGNMENT 64
+
+/* An offset holds the index of its region plus 1 in the bits above
+ * _SA_OFF_SHIFT, and the position inside the region below them. */
+#define _SA_OFF_SHIFT 40
+
+typedef struct sa_image_header
+{
+    char _magic[8];
+    uint64_t _region_count;
+    uint64_t _root;
+    uint64_t _size; // size of the whole image
+} sa_image_header;
+
+typedef struct sa_image_region
+{
+    uint64_t _offset; // file offset of the contents
+    uint64_t _size;
+} sa_image_region;
+
+struct sarena_image
+{
+    const char* _base;
+    size_t _size;
+
+    const sa_image_header* _header;
+    const sa_image_region* _regions;
+};
+
+static sarena_off_t _sa_off_make(size_t index, size_t offset);
+static size_t _sa_image_region_offset(const sa_region* region, size_t pos);
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct sa_debug_record sa_debug_record;
+
+/* Header placed right before every allocation in debug mode. */
+
+struct sa_debug_record
+{
+    sa_debug_record* _prev; // allocated before this one
+    size_t _size;
+    void* _site;
+
+    uintptr_t _canary; // address of the record mixed with _SA_DEBUG_CANARY
+};
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct sa_cleanup sa_cleanup;
+
+/* A cleanup callback, allocated from the arena it belongs to. */
+
+struct sa_cleanup
+{
+    sarena_cleanup_fn _fn;
+    void* _ctx;
+
+    sa_cleanup* _prev; // registered before this one
+};
+
+/* -------------------------------------------------------------------------- */
+
+#define _SA_CACHE_LINE 64
+
+typedef struct sa_epoch_reader sa_epoch_reader;
+
+/* Readers are kept on separate cache lines, so entering and leaving sections
+ * does not slow down the other readers. */
+
+struct sa_epoch_reader
+{
+    size_t _epoch; // epoch the reader entered, 0 outside of a section
+    int _registered;
+
+    char _pad[_SA_CACHE_LINE - sizeof(size_t) - sizeof(int)];
+};
+
+/* The domain starts on a cache line of its own, and the header is padded so
+ * the readers do not share lines with each other or with '_global', which
+ * the writers bump on every advance. */
+
+struct sarena_epoch
+{
+    size_t _global; // current epoch, starting at 1
+    size_t _count;
+
+    void* _mem_block; // block the domain was placed in
+
+    char _pad[_SA_CACHE_LINE - 2 * sizeof(size_t) - sizeof(void*)];
+
+    sa_epoch_reader _readers[];
+};
+
+typedef struct sa_limbo sa_limbo;
+
+/* Regions released in epoch '_epoch', linked through their '_next' pointers,
+ * which may be taken back once no reader is inside a section of that epoch
+ * or an older one. */
+
+struct sa_limbo
+{
+    sa_region* _head;
+    sa_region* _tail;
+    size_t _count;
+
+    size_t _epoch;
+    sa_cleanup* _cleanups; // callbacks registered for the released memory
+    int _release; // released by sarena_reset(), so the regions are freed
+};
+
+/* Number of batches of released regions an arena keeps apart. Beyond that,
+ * the two most recent batches are merged. */
+#define _SA_LIMBO_MAX 4
+
+static size_t _sa_epoch_oldest(sarena_epoch* epoch);
+
+/* -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- */
+
+struct sarena
+{
+    sa_hot _hot; // must be the first member
+
+    sa_region_list _regions;
+    size_t _region_cap; // capacity of the first region
+    sa_backing _backing;
+
+    size_t _growth_factor;
+    size_t _max_region_cap;
+    size_t _next_cap; // capacity of the next region to be allocated
+    int _concurrent;
+
+    /* Unique ID of the arena and the number of times it was rewinded/reset.
+     * Used to invalidate the chunks cached by sarena_tls_malloc(). */
+    size_t _id;
+    size_t _generation;
+
+    /* Number of times all allocations were released, by sarena_rewind() or
+     * sarena_reset(), which unlike sarena_rewind_to() invalidates every pool
+     * slot. */
+    size_t _releases;
+
+    /* Regions before '_curr' with the most free space left, which are used
+     * for allocations that do not fit '_curr'. Unused slots are NULL. Only
+     * used by non-concurrent arenas. */
+    sa_region* _spares[SARENA_SPARE_MAX];
+    size_t _spare_count; // number of usable slots
+
+    size_t _peak; // see 'sarena_stats_t.peak'
+
+    /* Registered cleanup callbacks, most recent first. */
+    sa_cleanup* _cleanups;
+
+    /* Live allocations, most recent first. Only tracked if SARENA_DEBUG is
+     * defined. */
+    sa_debug_record* _debug;
+
+    int _in_buffer; // the arena object lives in a caller-provided buffer
+
+    /* See 'sarena_options.epoch'. Batches of released regions, oldest
+     * first. */
+    sarena_epoch* _epoch;
+    sa_limbo _limbo[_SA_LIMBO_MAX];
+    size_t _limbo_count;
+
+    /* See 'sarena_options.prefetch_percent' and 'prefetch_thread'. */
+    size_t _prefetch_percent;
+    sa_prefetcher* _prefetcher;
+
+    /* Usage at the last '_trim_window' rewinds, see 'sarena_options.trim_window'. */
+    size_t _trim_window;
+    size_t _trim_pos;
+    size_t _trim_history[SARENA_TRIM_WINDOW_MAX];
+
+    /* Virtual memory backend. '_vm_base' is NULL for malloc-backed arenas.
+     * The single region lives inside the reserved range, and its
+     * '_total_cap' is the number of committed bytes of its memory pool. */
+    char* _vm_base;
+    size_t _vm_size; // size of the reserved range
+    size_t _vm_commit_size; // commit granularity
+    size_t _vm_pool_cap; // reserved bytes usable by the memory pool
+};
+
+static void* _sa_backing_alloc(const sa_backing* backing, size_t size)
+{
+    if(backing->_allocator.alloc == NULL)
+        return malloc(size);
+
+    return backing->_allocator.alloc(backing->_allocator.ctx, size);
+}
+
+static void _sa_backing_free(const sa_backing* backing, void* ptr, size_t size)
+{
+    if(backing->_allocator.alloc == NULL)
+        free(ptr);
+    else if(backing->_allocator.free != NULL)
+        backing->_allocator.free(backing->_allocator.ctx, ptr, size);
+}
+
+static sa_region* _sa_region_alloc(size_t total_cap, const sa_backing* backing)
+{
+    size_t alignment = backing->_alignment;
+    size_t block_size;
+    void* mem_block;
+    size_t origin;
+
+    if((backing->_huge_pages != SARENA_HUGE_PAGES_NONE) ||
+            (backing->_numa_node >= 0))
+    {
+        size_t slack = (alignment > _SA_MALLOC_ALIGNMENT) ? (alignment - 1) : 0;
+
+        if(total_cap > SIZE_MAX - _SA_REGION_HEADER_SIZE - slack)
+            return NULL;
+
+        block_size = _SA_REGION_HEADER_SIZE + total_cap + slack;
+        mem_block = _sa_pages_alloc(block_size, backing->_huge_pages,
+                backing->_numa_node, &block_size);
+        origin = _SA_REGION_PAGES;
+    }
+    else
+    {
+        if(backing->_cache != NULL)
+        {
+            sa_region* cached = _sa_region_cache_take(backing->_cache,
+                    total_cap, alignment);
+            if(cached != NULL)
+            {
+                // whatever the previous owner left behind is not known
+                cached->_dirty_cap = cached->_total_cap;
+                cached->_fast_cap = cached->_total_cap;
+                cached->_floor_releases = SIZE_MAX;
+                _sa_poison(cached->_mem_pool, cached->_total_cap);
+                return cached;
+            }
+        }
+
+        int aligned_by_malloc = (alignment <= _SA_MALLOC_ALIGNMENT) &&
+        ((_SA_REGION_HEADER_SIZE % alignment) == 0);
+        size_t slack = aligned_by_malloc ? 0 : (alignment - 1);
+
+        if(total_cap > SIZE_MAX - _SA_REGION_HEADER_SIZE - slack)
+            return NULL;
+
+        block_size = _SA_REGION_HEADER_SIZE + total_cap + slack;
+        mem_block = _sa_backing_alloc(backing, block_size);
+        origin = _SA_REGION_MALLOC;
+    }
+
+    if(mem_block == NULL) return NULL;
+
+    uintptr_t pool_addr = _sa_align_up(
+            (uintptr_t)mem_block + _SA_REGION_HEADER_SIZE, alignment);
+
+    sa_region* new_region = (sa_region*)(pool_addr - _SA_REGION_HEADER_SIZE);
+
+    new_region->_next = NULL;
+    new_region->_used_cap = 0;
+    new_region->_mem_block = mem_block;
+    new_region->_block_size = block_size;
+    new_region->_origin = origin;
+
+    // page-backed blocks may have been rounded up, use the whole block
+    new_region->_total_cap = (size_t)((char*)mem_block + block_size -
+            new_region->_mem_pool);
+    new_region->_fast_cap = new_region->_total_cap;
+
+    // mapped pages are zero, malloc() makes no promises
+    new_region->_dirty_cap = (origin == _SA_REGION_PAGES) ?
+        0 : new_region->_total_cap;
+    new_region->_floor_releases = SIZE_MAX;
+
+    _sa_poison(new_region->_mem_pool, new_region->_total_cap);
+
+    return new_region;
+}
+
+static void _sa_region_destroy(sa_region* region, const sa_backing* backing)
+{
+    _sa_region_mark_dirty(region);
+    _sa_unpoison(region->_mem_pool, region->_total_cap);
+
+    switch(region->_origin)
+    {
+        case _SA_REGION_MALLOC:
+            if((backing->_cache != NULL) &&
+                    (_sa_region_cache_put(backing->_cache, region) == 0))
+                break;
+
+            _sa_backing_free(backing, region->_mem_block, region->_block_size);
+            break;
+        case _SA_REGION_PAGES:
+            _sa_vm_release(region->_mem_block, region->_block_size);
+            break;
+        case _SA_REGION_VM: // released together with the arena
+        case _SA_REGION_BUFFER: // owned by the caller
+            break;
+    }
+}
+
+/* Accounts for the used part of the memory pool before it is given back. */
+static void _sa_region_mark_dirty(sa_region* region)
+{
+    size_t used_cap = __atomic_load_n(&region->_used_cap, __ATOMIC_RELAXED);
+    size_t total_cap = __atomic_load_n(&region->_total_cap, __ATOMIC_RELAXED);
+
+    if(used_cap > total_cap) // see _sarena_malloc_concurrent()
+        used_cap = total_cap;
+
+    if(used_cap > __atomic_load_n(&region->_dirty_cap, __ATOMIC_RELAXED))
+        __atomic_store_n(&region->_dirty_cap, used_cap, __ATOMIC_RELAXED);
+}
+
+/* Zeroes the memory pool of an empty region. */
+static void _sa_region_zero(sa_region* region)
+{
+    if(region->_dirty_cap == 0) return;
+
+    _sa_unpoison(region->_mem_pool, region->_dirty_cap);
+
+    if((region->_origin == _SA_REGION_PAGES) ||
+            (region->_origin == _SA_REGION_VM))
+        _sa_pages_zero(region->_mem_pool, region->_dirty_cap);
+    else
+        _sa_zero(region->_mem_pool, region->_dirty_cap);
+
+    _sa_poison(region->_mem_pool, region->_dirty_cap);
+    region->_dirty_cap = 0;
+}
+
+/* Lowers the used capacity of the region to 'used_cap', giving back the rest
+ * of its memory pool. In debug mode, the released memory is filled with a
+ * pattern and poisoned. */
+static void _sa_region_rewind(sa_region* region, size_t used_cap)
+{
+    _sa_region_mark_dirty(region);
+
+#ifdef SARENA_DEBUG
+    size_t old_used = _sa_region_used(region);
+
+    if(old_used > used_cap)
+    {
+        _sa_unpoison(region->_mem_pool + used_cap, old_used - used_cap);
+        memset(region->_mem_pool + used_cap, _SA_DEBUG_FREED_BYTE,
+                old_used - used_cap);
+    }
+
+    _sa_poison(region->_mem_pool + used_cap, region->_total_cap - used_cap);
+#endif
+
+    region->_used_cap = used_cap;
+}
+
+/* Concurrent arenas mark full regions by letting '_used_cap' overflow
+ * '_total_cap', so it is clamped. */
+static size_t _sa_region_used(const sa_region* region)
+{
+    size_t used = __atomic_load_n(&region->_used_cap, __ATOMIC_RELAXED);
+
+    return (used < region->_total_cap) ? used : region->_total_cap;
+}
+
+/* Pages are touched this far apart, which is the smallest page size of all
+ * supported platforms. */
+#define _SA_PREFAULT_STRIDE 4096
+
+/* Number of cache lines of a region prefetched before it becomes active. */
+#define _SA_PREFETCH_LINES 4
+
+/* Writes a zero to every page of the memory pool of an empty region, so its
+ * pages are faulted in before it is allocated from. Memory known to be zero
+ * stays zero. Skipped with AddressSanitizer, to which the pool is poisoned. */
+static void _sa_region_prefault(sa_region* region)
+{
+#ifndef _SA_HAVE_ASAN
+    volatile char* pool = region->_mem_pool;
+
+    size_t pos;
+    for(pos = 0; pos < region->_total_cap; pos += _SA_PREFAULT_STRIDE)
+        pool[pos] = 0;
+#else
+    (void)region;
+#endif
+}
+
+static void _sa_region_prefetch(const sa_region* region)
+{
+    __builtin_prefetch(region, 1, 3);
+
+    size_t i;
+    for(i = 0; i < _SA_PREFETCH_LINES; i++)
+        __builtin_prefetch(region->_mem_pool + i * _SA_CACHE_LINE, 1, 3);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void _sa_region_list_init(sa_region_list* list)
+{
+    list->_count = 0;
+    list->_head = NULL;
+    list->_tail = NULL;
+}
+
+static int _sa_region_list_push_back(sa_region_list* list, size_t total_cap,
+        const sa_backing* backing)
+{
+    sa_region* new = _sa_region_alloc(total_cap, backing);
+    if(new == NULL) return 1;
+
+    if(list->_head == NULL)
+    {
+        list->_head = new;
+        list->_tail = new;
+    }
+    else
+    {
+        list->_tail->_next = new;
+        list->_tail = new;
+    }
+
+    list->_count++;
+
+    return 0;
+}
+
+static int _sa_region_list_insert_after(sa_region_list* list, sa_region* pos,
+        size_t total_cap, const sa_backing* backing)
+{
+    sa_region* new = _sa_region_alloc(total_cap, backing);
+    if(new == NULL) return 1;
+
+    _sa_region_list_link_after(list, pos, new);
+
+    return 0;
+}
+
+static void _sa_region_list_link_after(sa_region_list* list, sa_region* pos,
+        sa_region* region)
+{
+    region->_next = pos->_next;
+    pos->_next = region;
+
+    if(pos == list->_tail)
+        list->_tail = region;
+
+    list->_count++;
+}
+
+static void _sa_region_list_pop_front(sa_region_list* list,
+        const sa_backing* backing)
+{
+    if(list->_head == list->_tail)
+    {
+        _sa_region_destroy(list->_head, backing);
+        list->_head = NULL;
+        list->_tail = NULL;
+    }
+    else
+    {
+        sa_region* old_head = list->_head;
+
+        list->_head = list->_head->_next;
+
+        _sa_region_destroy(old_head, backing);
+    }
+
+    list->_count--;
+}
+
+/* Destroys all regions after 'pos', making it the tail of the list. */
+static void _sa_region_list_truncate(sa_region_list* list, sa_region* pos,
+        const sa_backing* backing)
+{
+    sa_region* it = pos->_next;
+
+    while(it != NULL)
+    {
+        sa_region* next = it->_next;
+        _sa_region_destroy(it, backing);
+        list->_count--;
+        it = next;
+    }
+
+    pos->_next = NULL;
+    list->_tail = pos;
+}
+
+/* Destroys the region after 'pos'. */
+static void _sa_region_list_erase_after(sa_region_list* list, sa_region* pos,
+        const sa_backing* backing)
+{
+    sa_region* erased = pos->_next;
+
+    pos->_next = erased->_next;
+    if(erased == list->_tail)
+        list->_tail = pos;
+
+    _sa_region_destroy(erased, backing);
+    list->_count--;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void _sa_region_cache_lock(sarena_region_cache* cache)
+{
+    while(__atomic_test_and_set(&cache->_lock, __ATOMIC_ACQUIRE))
+    {
+        while(__atomic_load_n(&cache->_lock, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+static void _sa_region_cache_unlock(sarena_region_cache* cache)
+{
+    __atomic_clear(&cache->_lock, __ATOMIC_RELEASE);
+}
+
+static size_t _sa_region_cache_bin(size_t total_cap)
+{
+    size_t bin = 0;
+
+    while((total_cap >>= 1) != 0)
+        bin++;
+
+    return bin;
+}
+
+/* Matching regions are at most twice as large as requested, so they can only
+ * be found in the bin of 'total_cap' and the one after it. */
+static sa_region* _sa_region_cache_take(sarena_region_cache* cache,
+        size_t total_cap, size_t alignment)
+{
+    if(total_cap == 0) return NULL;
+
+    size_t max_cap = (total_cap > SIZE_MAX / 2) ? SIZE_MAX : (total_cap * 2);
+    size_t first_bin = _sa_region_cache_bin(total_cap);
+    size_t last_bin = (first_bin + 1 < _SA_CACHE_BINS) ?
+        (first_bin + 1) : first_bin;
+
+    _sa_region_cache_lock(cache);
+
+    size_t bin;
+    for(bin = first_bin; bin <= last_bin; bin++)
+    {
+        sa_region** it = &cache->_bins[bin];
+
+        for(; *it != NULL; it = &(*it)->_next)
+        {
+            sa_region* region = *it;
+
+            if((region->_total_cap < total_cap) ||
+                    (region->_total_cap >= max_cap) ||
+                    (((uintptr_t)region->_mem_pool & (alignment - 1)) != 0))
+                continue;
+
+            *it = region->_next;
+            cache->_cached_cap -= region->_block_size;
+            _sa_region_cache_unlock(cache);
+
+            region->_next = NULL;
+            region->_used_cap = 0;
+
+            return region;
+        }
+    }
+
+    _sa_region_cache_unlock(cache);
+
+    return NULL;
+}
+
+/* Return value:
+ * ON SUCCESS: 0, the cache now owns the region;
+ * ON FAILURE: 1, the cache is full. */
+static int _sa_region_cache_put(sarena_region_cache* cache, sa_region* region)
+{
+    size_t bin = _sa_region_cache_bin(region->_total_cap);
+
+    _sa_region_cache_lock(cache);
+
+    if(region->_block_size > cache->_retain_cap - cache->_cached_cap)
+    {
+        _sa_region_cache_unlock(cache);
+        return 1;
+    }
+
+    region->_next = cache->_bins[bin];
+    cache->_bins[bin] = region;
+    cache->_cached_cap += region->_block_size;
+
+    _sa_region_cache_unlock(cache);
+
+    return 0;
+}
+
+static void* _sa_region_cache_take_arena(sarena_region_cache* cache)
+{
+    _sa_region_cache_lock(cache);
+
+    void* arena = cache->_arenas;
+
+    if(arena != NULL)
+    {
+        memcpy(&cache->_arenas, arena, sizeof(void*));
+        cache->_cached_cap -= sizeof(sarena);
+    }
+
+    _sa_region_cache_unlock(cache);
+
+    return arena;
+}
+
+static int _sa_region_cache_put_arena(sarena_region_cache* cache, void* arena)
+{
+    _sa_region_cache_lock(cache);
+
+    if(sizeof(sarena) > cache->_retain_cap - cache->_cached_cap)
+    {
+        _sa_region_cache_unlock(cache);
+        return 1;
+    }
+
+    memcpy(arena, &cache->_arenas, sizeof(void*));
+    cache->_arenas = arena;
+    cache->_cached_cap += sizeof(sarena);
+
+    _sa_region_cache_unlock(cache);
+
+    return 0;
+}
+
+/* Frees cached objects until the cache respects its retention limit. Must be
+ * called with the cache locked. Larger regions are freed first. */
+static void _sa_region_cache_shrink(sarena_region_cache* cache)
+{
+    size_t bin = _SA_CACHE_BINS;
+
+    while((cache->_cached_cap > cache->_retain_cap) && (bin > 0))
+    {
+        sa_region* region = cache->_bins[bin - 1];
+
+        if(region == NULL)
+        {
+            bin--;
+            continue;
+        }
+
+        cache->_bins[bin - 1] = region->_next;
+        cache->_cached_cap -= region->_block_size;
+        free(region->_mem_block);
+    }
+
+    while((cache->_cached_cap > cache->_retain_cap) &&
+            (cache->_arenas != NULL))
+    {
+        void* arena = cache->_arenas;
+
+        memcpy(&cache->_arenas, arena, sizeof(void*));
+        cache->_cached_cap -= sizeof(sarena);
+        free(arena);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int _sarena_init(sarena* arena, const sarena_options* opts,
+        sa_region* first);
+static int _sarena_init_vm(sarena* arena, size_t reserve_cap);
+static int _sarena_vm_commit(sarena* arena, size_t pool_cap);
+static void _sarena_grow(sarena* arena);
+static size_t _sarena_used(const sarena* arena);
+static void _sarena_rewind(sarena* arena);
+static size_t _sarena_sample_peak(sarena* arena);
+static void _sarena_auto_trim(sarena* arena, size_t used);
+static void _sarena_trim_vm(sarena* arena, size_t keep_cap);
+static void _sarena_count_alloc(sarena* arena, size_t count);
+static int _sarena_holds(const sarena* arena, const void* ptr, size_t size,
+        const sa_region** hint);
+static int _sarena_pool_sync(sarena_pool* pool);
+static void _sarena_rewind_region_to(sarena* arena, sa_region* region,
+        size_t used_cap);
+static void _sarena_run_cleanups(sarena* arena, sa_cleanup* stop);
+static void _sarena_zero_block(sarena* arena, void* ptr, size_t size);
+static int _sarena_region_top_is(const sa_region* region, const char* ptr,
+        size_t size, size_t alignment, size_t* used_cap);
+static int _sarena_resize_last(sarena* arena, void* ptr, size_t old_size,
+        size_t new_size);
+static void* _sarena_malloc(sarena* arena, size_t size, size_t alignment);
+static void* _sarena_malloc_plain(sarena* arena, size_t size,
+        size_t alignment);
+static void _sarena_debug_drop(sarena* arena, sa_debug_record* stop);
+static void _sarena_debug_repoison(sarena* arena);
+#ifdef SARENA_DEBUG
+static void* _sarena_debug_malloc(sarena* arena, size_t size,
+        size_t alignment);
+static void _sarena_debug_check(const sa_debug_record* record);
+#endif
+static sa_region* _sarena_find_region(sarena* arena, size_t size,
+        size_t alignment);
+static sa_region* _sarena_find_spare(const sarena* arena, size_t size,
+        size_t alignment);
+static void _sarena_retire(sarena* arena, sa_region* region);
+static void _sarena_clear_spares(sarena* arena);
+static void* _sarena_malloc_concurrent(sarena* arena, size_t size,
+        size_t alignment);
+static int _sarena_advance_concurrent(sarena* arena, sa_region* curr);
+static sa_region* _sarena_claim_next_concurrent(sarena* arena,
+        sa_region* curr, size_t reserve);
+static sa_region* _sarena_insert_concurrent(sarena* arena, sa_region* curr,
+        size_t total_cap, size_t used_cap);
+static void _sarena_fix_tail_concurrent(sarena* arena);
+static void _sarena_defer(sarena* arena, int release);
+static void _sarena_limbo_push(sarena* arena, const sa_limbo* batch);
+static void _sarena_reclaim(sarena* arena, int keep);
+static void _sarena_take_back(sarena* arena, sa_limbo* batch, int keep);
+static void _sarena_arm_prefetch(sarena* arena);
+static void _sarena_prefetch(sarena* arena);
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct sa_tls_cache sa_tls_cache;
+
+struct sa_tls_cache
+{
+    size_t _arena_id; // 0 if the slot is empty
+    size_t _generation;
+
+    char* _pos;
+    char* _end;
+};
+
+static __thread sa_tls_cache _sa_tls_caches[SARENA_TLS_SLOTS];
+
+static size_t _sa_next_arena_id = 1;
+
+/* -------------------------------------------------------------------------- */
+
+sarena* sarena_create(size_t region_cap)
+{
+    sarena_options opts = { .region_cap = region_cap };
+
+    return sarena_create_with(&opts);
+}
+
+sarena* sarena_create_aligned(size_t region_cap, size_t alignment)
+{
+    if(alignment == 0) return NULL;
+
+    sarena_options opts = { .region_cap = region_cap, .alignment = alignment };
+
+    return sarena_create_with(&opts);
+}
+
+sarena* sarena_create_concurrent(size_t region_cap)
+{
+    sarena_options opts = { .region_cap = region_cap, .concurrent = 1 };
+
+    return sarena_create_with(&opts);
+}
+
+sarena* sarena_create_with(const sarena_options* opts)
+{
+    if(opts == NULL) return NULL;
+
+    sarena* new = NULL;
+    sa_backing backing = { ._alignment = 0 };
+
+    if(opts->allocator != NULL)
+        backing._allocator = *opts->allocator;
+    else if(opts->region_cache != NULL)
+        new = (sarena*)_sa_region_cache_take_arena(opts->region_cache);
+
+    if(new == NULL)
+        new = (sarena*)_sa_backing_alloc(&backing, sizeof(sarena));
+
+    if(new == NULL) return NULL;
+
+    int status = _sarena_init(new, opts, NULL);
+
+    if(status != 0)
+    {
+        _sa_backing_free(&backing, new, sizeof(sarena));
+        return NULL;
+    }
+    else return new;
+}
+
+void sarena_destroy(sarena* arena)
+{
+    if(arena == NULL) return;
+
+    _sarena_run_cleanups(arena, NULL);
+    _sarena_debug_drop(arena, NULL);
+
+    if(arena->_prefetcher != NULL)
+        _sa_prefetcher_destroy(arena->_prefetcher);
+
+    // the readers must be done with the arena by now
+    while(arena->_limbo_count > 0)
+    {
+        arena->_limbo_count--;
+        _sarena_take_back(arena, &arena->_limbo[arena->_limbo_count], 0);
+    }
+
+    while(arena->_regions._count > 0)
+        _sa_region_list_pop_front(&arena->_regions, &arena->_backing);
+
+    if(arena->_vm_base != NULL)
+        _sa_vm_release(arena->_vm_base, arena->_vm_size);
+
+    sa_backing backing = arena->_backing;
+
+    arena->_region_cap = 0;
+    arena->_hot._alignment = 0;
+    arena->_hot._curr = NULL;
+
+    if(arena->_in_buffer) return;
+
+    if((backing._cache == NULL) ||
+            (_sa_region_cache_put_arena(backing._cache, arena) != 0))
+        _sa_backing_free(&backing, arena, sizeof(sarena));
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void* _sa_parent_alloc(void* ctx, size_t size)
+{
+    return sarena_malloc_aligned((sarena*)ctx, size, _SA_MALLOC_ALIGNMENT);
+}
+
+sarena_allocator sarena_allocator_of(sarena* parent)
+{
+    sarena_allocator allocator = { _sa_parent_alloc, NULL, parent };
+
+    return allocator;
+}
+
+static void* _sa_null_alloc(void* ctx, size_t size)
+{
+    (void)ctx; (void)size;
+    return NULL;
+}
+
+sarena* sarena_init_in_buffer(void* buf, size_t len)
+{
+    if(buf == NULL) return NULL;
+
+    uintptr_t start = (uintptr_t)buf;
+    uintptr_t end = start + len;
+    if(end < start) return NULL;
+
+    uintptr_t arena_addr = _sa_align_up(start, _SA_MALLOC_ALIGNMENT);
+    uintptr_t pool_addr = _sa_align_up(arena_addr + sizeof(sarena) +
+            _SA_REGION_HEADER_SIZE, SARENA_DEFAULT_ALIGNMENT);
+
+    if((arena_addr < start) || (pool_addr >= end)) return NULL;
+
+    sarena* arena = (sarena*)arena_addr;
+    sa_region* region = (sa_region*)(pool_addr - _SA_REGION_HEADER_SIZE);
+
+    region->_next = NULL;
+    region->_used_cap = 0;
+    region->_total_cap = (size_t)(end - pool_addr);
+    region->_fast_cap = region->_total_cap;
+    region->_mem_block = buf;
+    region->_block_size = len;
+    region->_origin = _SA_REGION_BUFFER;
+    region->_dirty_cap = region->_total_cap;
+    region->_floor_releases = SIZE_MAX;
+    _sa_poison(region->_mem_pool, region->_total_cap);
+
+    // further regions cannot be allocated
+    sarena_allocator allocator = { _sa_null_alloc, NULL, NULL };
+    sarena_options opts = {
+        .region_cap = region->_total_cap,
+        .allocator = &allocator
+    };
+
+    if(_sarena_init(arena, &opts, region) != 0) return NULL;
+
+    arena->_in_buffer = 1;
+
+    return arena;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static sarena_region_cache _sa_global_region_cache;
+
+sarena_region_cache* sarena_region_cache_create(size_t retain_cap)
+{
+    sarena_region_cache* new = (sarena_region_cache*)calloc(1,
+            sizeof(sarena_region_cache));
+    if(new == NULL) return NULL;
+
+    new->_retain_cap = retain_cap;
+
+    return new;
+}
+
+void sarena_region_cache_destroy(sarena_region_cache* cache)
+{
+    if((cache == NULL) || (cache == &_sa_global_region_cache)) return;
+
+    cache->_retain_cap = 0;
+    _sa_region_cache_shrink(cache);
+
+    free(cache);
+}
+
+void sarena_region_cache_set_retain(sarena_region_cache* cache,
+        size_t retain_cap)
+{
+    if(cache == NULL) return;
+
+    _sa_region_cache_lock(cache);
+
+    cache->_retain_cap = retain_cap;
+    _sa_region_cache_shrink(cache);
+
+    _sa_region_cache_unlock(cache);
+}
+
+sarena_region_cache* sarena_region_cache_global(void)
+{
+    return &_sa_global_region_cache;
+}
+
+void* sarena_malloc_slow(sarena* arena, size_t size)
+{
+    if(arena == NULL) return NULL;
+
+    _SA_CALL_SITE();
+
+    void* alloc_addr = _sarena_malloc(arena, size, arena->_hot._alignment);
+
+    if(alloc_addr != NULL)
+        _sarena_count_alloc(arena, 1);
+
+    return alloc_addr;
+}
+
+void* sarena_malloc_aligned(sarena* arena, size_t size, size_t alignment)
+{
+    if(arena == NULL) return NULL;
+    if(!_sa_is_pow2(alignment)) return NULL;
+
+    if(alignment < arena->_hot._alignment)
+        alignment = arena->_hot._alignment;
+
+    _SA_CALL_SITE();
+
+    void* alloc_addr = _sarena_malloc(arena, size, alignment);
+
+    if(alloc_addr != NULL)
+        _sarena_count_alloc(arena, 1);
+
+    return alloc_addr;
+}
+
+void* sarena_calloc(sarena* arena, size_t size)
+{
+    if(arena == NULL) return NULL;
+
+    _SA_CALL_SITE();
+
+    void* alloc_addr = _sarena_malloc(arena, size, arena->_hot._alignment);
+
+    if(alloc_addr != NULL)
+    {
+        _sarena_count_alloc(arena, 1);
+        _sarena_zero_block(arena, alloc_addr, size);
+    }
+
+    return alloc_addr;
+}
+
+void* sarena_malloc_array(sarena* arena, size_t elem_size, size_t count)
+{
+    if((arena == NULL) || (elem_size == 0) || (count == 0)) return NULL;
+    if(count > SIZE_MAX / elem_size) return NULL;
+
+    _SA_CALL_SITE();
+
+    void* alloc_addr = _sarena_malloc(arena, elem_size * count,
+            arena->_hot._alignment);
+
+    if(alloc_addr != NULL)
+        _sarena_count_alloc(arena, 1);
+
+    return alloc_addr;
+}
+
+size_t sarena_malloc_n(sarena* arena, size_t elem_size, size_t count,
+        void** out_ptrs)
+{
+    if((arena == NULL) || (elem_size == 0) || (count == 0) ||
+            (out_ptrs == NULL)) return 0;
+
+    size_t alignment = arena->_hot._alignment;
+    size_t stride = _sa_align_up(elem_size, alignment);
+    if(stride < elem_size) return 0;
+
+    size_t done = 0;
+
+    _SA_CALL_SITE();
+
+#ifdef SARENA_DEBUG
+    // every block gets its own redzone
+    for(; done < count; done++)
+    {
+        out_ptrs[done] = _sarena_malloc(arena, elem_size, alignment);
+        if(out_ptrs[done] == NULL) break;
+    }
+
+    _sarena_count_alloc(arena, done);
+
+    return done;
+#endif
+
+    // fill the rest of the active region
+    if(!arena->_concurrent)
+    {
+        sa_region* region = arena->_hot._curr;
+        size_t offset = _sa_region_aligned_offset(region, alignment);
+
+        if(_sa_region_fits(region, offset, elem_size))
+        {
+            // the last block needs no padding after it
+            size_t fit = (region->_total_cap - offset - elem_size) / stride + 1;
+            size_t n = (fit < count) ? fit : count;
+
+            // always served by the active region, as the span fits it
+            char* it = (char*)_sarena_malloc(arena,
+                    (n - 1) * stride + elem_size, alignment);
+
+            if(it != NULL)
+            {
+                arena->_hot._waste += (n - 1) * (stride - elem_size);
+
+                for(; done < n; done++, it += stride)
+                    out_ptrs[done] = it;
+            }
+        }
+    }
+
+    // place the remaining blocks contiguously, wherever they fit
+    if(done < count)
+    {
+        size_t rest = count - done;
+        char* it = NULL;
+
+        if(rest - 1 <= (SIZE_MAX - elem_size) / stride)
+            it = (char*)_sarena_malloc(arena, (rest - 1) * stride + elem_size,
+                    alignment);
+
+        if(it != NULL)
+        {
+            if(!arena->_concurrent)
+                arena->_hot._waste += (rest - 1) * (stride - elem_size);
+
+            for(; done < count; done++, it += stride)
+                out_ptrs[done] = it;
+        }
+    }
+
+    _sarena_count_alloc(arena, done);
+
+    return done;
+}
+
+void* sarena_realloc(sarena* arena, void* ptr, size_t old_size,
+        size_t new_size)
+{
+    if(arena == NULL) return NULL;
+
+    if(ptr == NULL)
+        return sarena_malloc(arena, new_size);
+
+    if(new_size == 0)
+    {
+        sarena_free_last(arena, ptr, old_size);
+        return NULL;
+    }
+
+    if(_sarena_resize_last(arena, ptr, old_size, new_size) == 0)
+        return ptr;
+
+    if(new_size <= old_size)
+        return ptr;
+
+    _SA_CALL_SITE();
+
+    void* new = _sarena_malloc(arena, new_size, arena->_hot._alignment);
+    if(new == NULL) return NULL;
+
+    _sarena_count_alloc(arena, 1);
+    memcpy(new, ptr, old_size);
+
+    return new;
+}
+
+int sarena_grow(sarena* arena, void* ptr, size_t old_size, size_t new_size)
+{
+    if((arena == NULL) || (ptr == NULL)) return 1;
+
+    return _sarena_resize_last(arena, ptr, old_size, new_size);
+}
+
+void sarena_free_last(sarena* arena, void* ptr, size_t size)
+{
+    if((arena == NULL) || (ptr == NULL)) return;
+
+    _sarena_resize_last(arena, ptr, size, 0);
+}
+
+int sarena_pool_init(sarena_pool* pool, sarena* arena, size_t slot_size)
+{
+    if((pool == NULL) || (arena == NULL) || (slot_size == 0)) return 1;
+
+    if(slot_size < sizeof(void*))
+        slot_size = sizeof(void*);
+
+    slot_size = _sa_align_up(slot_size, arena->_hot._alignment);
+    if(slot_size > SIZE_MAX / SARENA_POOL_BATCH) return 1;
+
+    pool->_arena = arena;
+    pool->_slot_size = slot_size;
+    pool->_generation = __atomic_load_n(&arena->_generation, __ATOMIC_RELAXED);
+    pool->_releases = __atomic_load_n(&arena->_releases, __ATOMIC_RELAXED);
+    pool->_free = NULL;
+    pool->_pos = NULL;
+    pool->_end = NULL;
+
+    return 0;
+}
+
+void* sarena_pool_alloc(sarena_pool* pool)
+{
+    if(pool == NULL) return NULL;
+
+    sarena* arena = pool->_arena;
+
+    _sarena_pool_sync(pool);
+
+    void* slot = pool->_free;
+
+    if(slot != NULL)
+    {
+        _sa_unpoison(slot, pool->_slot_size);
+        memcpy(&pool->_free, slot, sizeof(void*));
+    }
+    else
+    {
+        if(pool->_pos == pool->_end)
+        {
+            _SA_CALL_SITE();
+
+            size_t chunk_size = pool->_slot_size * SARENA_POOL_BATCH;
+            char* chunk = (char*)_sarena_malloc(arena, chunk_size,
+                    arena->_hot._alignment);
+            if(chunk == NULL) return NULL;
+
+            pool->_pos = chunk;
+            pool->_end = chunk + chunk_size;
+        }
+
+        slot = pool->_pos;
+        pool->_pos += pool->_slot_size;
+    }
+
+    _sarena_count_alloc(arena, 1);
+
+    return slot;
+}
+
+void sarena_pool_free(sarena_pool* pool, void* ptr)
+{
+    if((pool == NULL) || (ptr == NULL)) return;
+
+    // slots the arena released are gone, never link them
+    int sync = _sarena_pool_sync(pool);
+
+    if((sync == 2) || ((sync == 1) && !_sarena_holds(pool->_arena, ptr,
+                    pool->_slot_size, NULL)))
+        return;
+
+#ifdef SARENA_DEBUG
+    memset(ptr, _SA_DEBUG_FREED_BYTE, pool->_slot_size);
+#endif
+
+    memcpy(ptr, &pool->_free, sizeof(void*));
+    pool->_free = ptr;
+
+    _sa_poison(ptr, pool->_slot_size);
+}
+
+void* sarena_tls_malloc(sarena* arena, size_t size)
+{
+    if(arena == NULL) return NULL;
+
+    size_t chunk_size = SARENA_TLS_CHUNK_SIZE;
+    if(chunk_size > arena->_region_cap / 4)
+        chunk_size = arena->_region_cap / 4;
+
+    size = _sa_align_up(size, arena->_hot._alignment);
+
+    // the blocks and chunk refills are reported with the caller's site
+    _SA_CALL_SITE();
+
+    int direct = (size == 0) || (size > chunk_size / 4);
+#ifdef SARENA_DEBUG
+    // chunks would hide overflows between the blocks carved out of them
+    direct = 1;
+#endif
+
+    if(direct)
+    {
+        void* block = _sarena_malloc(arena, size, arena->_hot._alignment);
+        if(block != NULL)
+            _sarena_count_alloc(arena, 1);
+
+        return block;
+    }
+
+    sa_tls_cache* cache = &_sa_tls_caches[arena->_id % SARENA_TLS_SLOTS];
+    size_t generation = __atomic_load_n(&arena->_generation, __ATOMIC_RELAXED);
+
+    if((cache->_arena_id != arena->_id) || (cache->_generation != generation)
+            || (size > (size_t)(cache->_end - cache->_pos)))
+    {
+        char* chunk = _sarena_malloc(arena, chunk_size, arena->_hot._alignment);
+        if(chunk == NULL) return NULL;
+
+        cache->_arena_id = arena->_id;
+        cache->_generation = generation;
+        cache->_pos = chunk;
+        cache->_end = chunk + chunk_size;
+    }
+
+    void* alloc_addr = cache->_pos;
+    cache->_pos += size;
+
+    _sarena_count_alloc(arena, 1);
+
+    return alloc_addr;
+}
+
+void sarena_rewind(sarena* arena)
+{
+    if(arena == NULL) return;
+
+    _SA_CALL_SITE();
+    _sarena_rewind(arena);
+}
+
+void sarena_rewind_zero(sarena* arena)
+{
+    if(arena == NULL) return;
+
+    _SA_CALL_SITE();
+    _sarena_rewind(arena);
+
+    sa_region* it = arena->_regions._head;
+
+    for(; it != NULL; it = it->_next)
+        _sa_region_zero(it);
+}
+
+sarena_mark_t sarena_mark(sarena* arena)
+{
+    sarena_mark_t mark = { 0 };
+
+    if(arena == NULL) return mark;
+
+    mark._region = arena->_hot._curr;
+    mark._used_cap = arena->_hot._curr->_used_cap;
+    mark._cleanup = arena->_cleanups;
+    mark._debug = arena->_debug;
+
+    size_t i;
+    for(i = 0; i < arena->_spare_count; i++)
+    {
+        mark._spares[i] = arena->_spares[i];
+        if(arena->_spares[i] != NULL)
+            mark._spare_used_caps[i] = arena->_spares[i]->_used_cap;
+    }
+
+    return mark;
+}
+
+void sarena_rewind_to(sarena* arena, sarena_mark_t mark)
+{
+    if((arena == NULL) || (mark._region == NULL)) return;
+
+    sa_region* region = (sa_region*)mark._region;
+
+    _sarena_run_cleanups(arena, (sa_cleanup*)mark._cleanup);
+    _sarena_debug_drop(arena, (sa_debug_record*)mark._debug);
+
+#ifdef SARENA_STATS
+    _sarena_sample_peak(arena);
+#endif
+#ifdef SARENA_TRACE
+    size_t used = _sarena_used(arena);
+#endif
+
+    // empty the regions entered after the mark was taken
+    if(region != arena->_hot._curr)
+    {
+        sa_region* it = region->_next;
+
+        for(; it != arena->_hot._curr; it = it->_next)
+        {
+            _sarena_rewind_region_to(arena, it, 0);
+        }
+
+        _sarena_rewind_region_to(arena, arena->_hot._curr, 0);
+    }
+
+    _sarena_rewind_region_to(arena, region, mark._used_cap);
+    arena->_hot._curr = region;
+    _sarena_arm_prefetch(arena);
+
+    // any later spare region was entered after the mark, and is now empty
+    size_t i;
+    for(i = 0; i < arena->_spare_count; i++)
+    {
+        sa_region* spare = (sa_region*)mark._spares[i];
+
+        arena->_spares[i] = spare;
+        if(spare != NULL)
+            _sarena_rewind_region_to(arena, spare,
+                    mark._spare_used_caps[i]);
+    }
+
+    _SA_CALL_SITE();
+    _SA_TRACE(arena, SARENA_TRACE_REWIND, rewind, NULL,
+            used - _sarena_used(arena));
+
+    __atomic_fetch_add(&arena->_generation, 1, __ATOMIC_RELAXED);
+}
+
+void sarena_trim(sarena* arena, size_t keep_cap)
+{
+    if((arena == NULL) || (arena->_regions._count == 0)) return;
+
+    if(arena->_vm_base != NULL)
+    {
+        _sarena_trim_vm(arena, keep_cap);
+        return;
+    }
+
+    // the regions up to the active one may hold allocations
+    size_t kept_cap = 0;
+    sa_region* it = arena->_regions._head;
+
+    for(; it != arena->_hot._curr; it = it->_next)
+        kept_cap += it->_total_cap;
+
+    kept_cap += it->_total_cap;
+
+    while(it->_next != NULL)
+    {
+        // a workload that ended inside a region needs all of it next time
+        if(kept_cap < keep_cap)
+        {
+            kept_cap += it->_next->_total_cap;
+            it = it->_next;
+        }
+        else _sa_region_list_erase_after(&arena->_regions, it,
+                &arena->_backing);
+    }
+}
+
+void sarena_stats(sarena* arena, sarena_stats_t* out)
+{
+    if((arena == NULL) || (out == NULL)) return;
+
+    out->used = 0;
+    out->reserved = 0;
+    out->region_count = 0;
+    out->deferred = 0;
+
+    sa_region* it = arena->_regions._head;
+
+    for(; it != NULL; it = it->_next)
+    {
+        size_t used = __atomic_load_n(&it->_used_cap, __ATOMIC_RELAXED);
+        size_t total = __atomic_load_n(&it->_total_cap, __ATOMIC_RELAXED);
+
+        out->used += (used < total) ? used : total;
+        out->reserved += total;
+        out->region_count++;
+    }
+
+    size_t i;
+    for(i = 0; i < arena->_limbo_count; i++)
+    {
+        for(it = arena->_limbo[i]._head; it != NULL; it = it->_next)
+            out->deferred += it->_total_cap;
+    }
+
+    if(out->used > arena->_peak)
+        arena->_peak = out->used;
+
+    out->peak = arena->_peak;
+    out->alloc_count = __atomic_load_n(&arena->_hot._alloc_count,
+            __ATOMIC_RELAXED);
+    out->waste = __atomic_load_n(&arena->_hot._waste, __ATOMIC_RELAXED);
+}
+
+int sarena_on_reset(sarena* arena, sarena_cleanup_fn fn, void* ctx)
+{
+    if((arena == NULL) || (fn == NULL)) return 1;
+
+    _SA_CALL_SITE();
+
+    size_t alignment = (arena->_hot._alignment > _SA_MALLOC_ALIGNMENT) ?
+        arena->_hot._alignment : _SA_MALLOC_ALIGNMENT;
+
+    sa_cleanup* cleanup = (sa_cleanup*)_sarena_malloc(arena,
+            sizeof(sa_cleanup), alignment);
+    if(cleanup == NULL) return 1;
+
+    cleanup->_fn = fn;
+    cleanup->_ctx = ctx;
+
+    if(arena->_concurrent)
+    {
+        sa_cleanup* prev = __atomic_load_n(&arena->_cleanups, __ATOMIC_RELAXED);
+        do cleanup->_prev = prev;
+        while(!__atomic_compare_exchange_n(&arena->_cleanups, &prev, cleanup,
+                    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    else
+    {
+        cleanup->_prev = arena->_cleanups;
+        arena->_cleanups = cleanup;
+    }
+
+    return 0;
+}
+
+void sarena_reset(sarena* arena)
+{
+    if(arena == NULL) return;
+
+    if(arena->_epoch == NULL)
+        _sarena_run_cleanups(arena, NULL);
+    _sarena_debug_drop(arena, NULL);
+
+    _SA_CALL_SITE();
+    _SA_TRACE(arena, SARENA_TRACE_RESET, reset, NULL, _sarena_used(arena));
+
+    if(arena->_epoch != NULL)
+        _sarena_defer(arena, 1);
+    else
+    {
+        _sa_region_list_truncate(&arena->_regions, arena->_regions._head,
+                &arena->_backing);
+
+        _sa_region_rewind(arena->_regions._head, 0);
+
+        if(arena->_vm_base != NULL) // keep only the first commit
+            _sarena_trim_vm(arena, 0);
+
+        arena->_hot._curr = arena->_regions._head;
+    }
+
+    if(arena->_prefetcher != NULL) // sized for the old growth
+        _sa_prefetcher_cancel(arena->_prefetcher);
+
+    _sarena_arm_prefetch(arena);
+    _sarena_clear_spares(arena);
+    arena->_next_cap = arena->_region_cap;
+    _sarena_grow(arena);
+    arena->_hot._waste = 0;
+    arena->_hot._alloc_count = 0;
+    arena->_peak = 0;
+    arena->_trim_pos = 0;
+    memset(arena->_trim_history, 0, sizeof(arena->_trim_history));
+    __atomic_fetch_add(&arena->_releases, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&arena->_generation, 1, __ATOMIC_RELAXED);
+}
+
+void sarena_set_trace(sarena_trace_fn fn, void* ctx, size_t sample_period)
+{
+#ifdef SARENA_TRACE
+    _sa_trace_fn = fn;
+    _sa_trace_ctx = ctx;
+    _sa_trace_period = sample_period;
+    _sa_trace_countdown = 0;
+#else
+    (void)fn; (void)ctx; (void)sample_period;
+#endif
+}
+
+sarena_ring* sarena_ring_create(size_t generations, const sarena_options* opts)
+{
+    if((generations < 2) || (opts == NULL)) return NULL;
+
+    if(generations > (SIZE_MAX - sizeof(sarena_ring)) / sizeof(sa_ring_slot))
+        return NULL;
+
+    sarena_ring* new = (sarena_ring*)calloc(1, sizeof(sarena_ring) +
+            generations * sizeof(sa_ring_slot));
+    if(new == NULL) return NULL;
+
+    new->_count = generations;
+    new->_current = 1;
+    new->_published = 0;
+
+    size_t i;
+    for(i = 0; i < generations; i++)
+    {
+        new->_slots[i]._arena = sarena_create_with(opts);
+        if(new->_slots[i]._arena == NULL)
+        {
+            sarena_ring_destroy(new);
+            return NULL;
+        }
+    }
+
+    new->_slots[1]._generation = 1;
+
+    return new;
+}
+
+void sarena_ring_destroy(sarena_ring* ring)
+{
+    if(ring == NULL) return;
+
+    size_t i;
+    for(i = 0; i < ring->_count; i++)
+    {
+        if(ring->_slots[i]._arena != NULL)
+            sarena_destroy(ring->_slots[i]._arena);
+    }
+
+    free(ring);
+}
+
+sarena* sarena_ring_current(sarena_ring* ring)
+{
+    if(ring == NULL) return NULL;
+
+    return ring->_slots[ring->_current % ring->_count]._arena;
+}
+
+sarena* sarena_ring_advance(sarena_ring* ring)
+{
+    if(ring == NULL) return NULL;
+
+    size_t next = ring->_current + 1;
+    sa_ring_slot* slot = &ring->_slots[next % ring->_count];
+
+    if(_sa_ring_slot_lock(slot) != 0)
+        return NULL;
+
+    sarena_rewind(slot->_arena);
+
+    // consumers which raced to acquire the old generation see the new number
+    __atomic_store_n(&slot->_generation, next, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->_readers, 0, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&ring->_published, ring->_current, __ATOMIC_RELEASE);
+    ring->_current = next;
+
+    return slot->_arena;
+}
+
+sarena* sarena_ring_acquire(sarena_ring* ring, size_t* generation)
+{
+    if((ring == NULL) || (generation == NULL)) return NULL;
+
+    while(1)
+    {
+        size_t published = __atomic_load_n(&ring->_published, __ATOMIC_ACQUIRE);
+        if(published == 0) return NULL;
+
+        sa_ring_slot* slot = &ring->_slots[published % ring->_count];
+
+        int readers = __atomic_load_n(&slot->_readers, __ATOMIC_RELAXED);
+        if(readers < 0) continue; // being rewinded, a newer one is coming
+
+        if(!__atomic_compare_exchange_n(&slot->_readers, &readers,
+                    readers + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+
+        // the slot may have been recycled before it was acquired
+        if(__atomic_load_n(&slot->_generation, __ATOMIC_RELAXED) != published)
+        {
+            __atomic_fetch_sub(&slot->_readers, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        *generation = published;
+        return slot->_arena;
+    }
+}
+
+void sarena_ring_release(sarena_ring* ring, size_t generation)
+{
+    if(ring == NULL) return;
+
+    sa_ring_slot* slot = &ring->_slots[generation % ring->_count];
+
+    // pairs with the acquire in _sa_ring_slot_lock()
+    __atomic_fetch_sub(&slot->_readers, 1, __ATOMIC_RELEASE);
+}
+
+sarena_epoch* sarena_epoch_create(size_t max_readers)
+{
+    if(max_readers == 0) return NULL;
+
+    if(max_readers > (SIZE_MAX - sizeof(sarena_epoch) - _SA_CACHE_LINE) /
+            sizeof(sa_epoch_reader))
+        return NULL;
+
+    void* block = calloc(1, sizeof(sarena_epoch) + _SA_CACHE_LINE - 1 +
+            max_readers * sizeof(sa_epoch_reader));
+    if(block == NULL) return NULL;
+
+    sarena_epoch* new = (sarena_epoch*)_sa_align_up((uintptr_t)block,
+            _SA_CACHE_LINE);
+
+    new->_mem_block = block;
+    new->_global = 1;
+    new->_count = max_readers;
+
+    return new;
+}
+
+void sarena_epoch_destroy(sarena_epoch* epoch)
+{
+    if(epoch == NULL) return;
+
+    free(epoch->_mem_block);
+}
+
+int sarena_epoch_register(sarena_epoch* epoch, size_t* reader)
+{
+    if((epoch == NULL) || (reader == NULL)) return 1;
+
+    size_t i;
+    for(i = 0; i < epoch->_count; i++)
+    {
+        int registered = 0;
+
+        if(__atomic_compare_exchange_n(&epoch->_readers[i]._registered,
+                    &registered, 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            *reader = i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void sarena_epoch_unregister(sarena_epoch* epoch, size_t reader)
+{
+    if((epoch == NULL) || (reader >= epoch->_count)) return;
+
+    __atomic_store_n(&epoch->_readers[reader]._registered, 0,
+            __ATOMIC_RELEASE);
+}
+
+void sarena_epoch_enter(sarena_epoch* epoch, size_t reader)
+{
+    // pairs with the release in _sarena_defer(), so everything unlinked
+    // before the epoch was bumped is not reachable anymore
+    size_t current = __atomic_load_n(&epoch->_global, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&epoch->_readers[reader]._epoch, current,
+            __ATOMIC_RELAXED);
+
+    // either the writer sees the reader inside the section, or the reader
+    // sees everything the writer did before looking
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void sarena_epoch_exit(sarena_epoch* epoch, size_t reader)
+{
+    __atomic_store_n(&epoch->_readers[reader]._epoch, 0, __ATOMIC_RELEASE);
+}
+
+sarena_off_t sarena_off(sarena* arena, const void* ptr)
+{
+    if((arena == NULL) || (ptr == NULL)) return SARENA_OFF_NULL;
+
+    uintptr_t addr = (uintptr_t)ptr;
+    sa_region* it = arena->_regions._head;
+
+    size_t i;
+    for(i = 0; it != NULL; it = it->_next, i++)
+    {
+        uintptr_t pool = (uintptr_t)it->_mem_pool;
+
+        if((addr >= pool) && (addr - pool < it->_total_cap))
+            return _sa_off_make(i, (size_t)(addr - pool));
+    }
+
+    return SARENA_OFF_NULL;
+}
+
+void* sarena_off_ptr(sarena* arena, sarena_off_t off)
+{
+    if((arena == NULL) || (off == SARENA_OFF_NULL)) return NULL;
+
+    sarena_off_t index = (off >> _SA_OFF_SHIFT) - 1;
+    sarena_off_t pos = off & (((sarena_off_t)1 << _SA_OFF_SHIFT) - 1);
+
+    sa_region* it = arena->_regions._head;
+
+    for(; (it != NULL) && (index > 0); index--)
+        it = it->_next;
+
+    if((it == NULL) || (pos >= it->_total_cap)) return NULL;
+
+    return it->_mem_pool + pos;
+}
+
+int sarena_save(sarena* arena, int fd, sarena_off_t root)
+{
+    if((arena == NULL) || !_SA_HAVE_FILES) return 1;
+
+    size_t count = arena->_regions._count;
+    size_t pos = sizeof(sa_image_header);
+
+    if(count > (SIZE_MAX - pos) / sizeof(sa_image_region)) return 1;
+    pos += count * sizeof(sa_image_region);
+
+    // the region table, which is written first, depends on the content sizes
+    sa_region* it = arena->_regions._head;
+    size_t data_pos = pos;
+
+    for(; it != NULL; it = it->_next)
+        data_pos = _sa_image_region_offset(it, data_pos) + _sa_region_used(it);
+
+    sa_image_header header;
+    memcpy(header._magic, _SA_IMAGE_MAGIC, sizeof(header._magic));
+    header._region_count = count;
+    header._root = root;
+    header._size = data_pos;
+
+    if(_sa_file_write(fd, &header, sizeof(header)) != 0) return 1;
+
+    data_pos = pos;
+    for(it = arena->_regions._head; it != NULL; it = it->_next)
+    {
+        sa_image_region entry;
+        entry._offset = _sa_image_region_offset(it, data_pos);
+        entry._size = _sa_region_used(it);
+
+        if(_sa_file_write(fd, &entry, sizeof(entry)) != 0) return 1;
+
+        data_pos = (size_t)(entry._offset + entry._size);
+    }
+
+    for(it = arena->_regions._head; it != NULL; it = it->_next)
+    {
+        size_t offset = _sa_image_region_offset(it, pos);
+        size_t used = _sa_region_used(it);
+
+        // headers and redzones are saved as well
+        _sa_unpoison(it->_mem_pool, used);
+
+        if((_sa_file_write_zeros(fd, offset - pos) != 0) ||
+                (_sa_file_write(fd, it->_mem_pool, used) != 0))
+        {
+            _sarena_debug_repoison(arena);
+            return 1;
+        }
+
+        pos = offset + used;
+    }
+
+    _sarena_debug_repoison(arena);
+
+    return 0;
+}
+
+sarena_image* sarena_map(const char* path)
+{
+    if(path == NULL) return NULL;
+
+    size_t size;
+    char* base = (char*)_sa_file_map(path, &size);
+    if(base == NULL) return NULL;
+
+    const sa_image_header* header = (const sa_image_header*)base;
+    const sa_image_region* regions = (const sa_image_region*)(header + 1);
+
+    int valid = (size >= sizeof(sa_image_header)) &&
+        (memcmp(header->_magic, _SA_IMAGE_MAGIC, sizeof(header->_magic)) == 0)
+        && (header->_size == size) &&
+        (header->_region_count <= (size - sizeof(sa_image_header)) /
+         sizeof(sa_image_region));
+
+    uint64_t i;
+    for(i = 0; valid && (i < header->_region_count); i++)
+    {
+        valid = (regions[i]._offset <= size) &&
+            (regions[i]._size <= size - regions[i]._offset);
+    }
+
+    sarena_image* image = valid ?
+        (sarena_image*)malloc(sizeof(sarena_image)) : NULL;
+
+    if(image == NULL)
+    {
+        _sa_file_unmap(base, size);
+        return NULL;
+    }
+
+    image->_base = base;
+    image->_size = size;
+    image->_header = header;
+    image->_regions = regions;
+
+    return image;
+}
+
+void sarena_unmap(sarena_image* image)
+{
+    if(image == NULL) return;
+
+    _sa_file_unmap((void*)image->_base, image->_size);
+    free(image);
+}
+
+sarena_off_t sarena_image_root(const sarena_image* image)
+{
+    return (image != NULL) ? image->_header->_root : SARENA_OFF_NULL;
+}
+
+const void* sarena_image_ptr(const sarena_image* image, sarena_off_t off)
+{
+    if((image == NULL) || (off == SARENA_OFF_NULL)) return NULL;
+
+    sarena_off_t index = (off >> _SA_OFF_SHIFT) - 1;
+    sarena_off_t pos = off & (((sarena_off_t)1 << _SA_OFF_SHIFT) - 1);
+
+    if(index >= image->_header->_region_count) return NULL;
+
+    const sa_image_region* region = &image->_regions[index];
+    if(pos >= region->_size) return NULL;
+
+    return image->_base + region->_offset + pos;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Reserves a ring slot for rewinding, which succeeds only if no consumer
+ * holds it.
+ *
+ * Return value:
+ * ON SUCCESS: 0;
+ * ON FAILURE: 1. */
+static int _sa_ring_slot_lock(sa_ring_slot* slot)
+{
+    int readers = 0;
+
+    return __atomic_compare_exchange_n(&slot->_readers, &readers, -1, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : 1;
+}
+
+#if _SA_HAVE_THREADS
+
+static void* _sa_prefetcher_main(void* arg)
+{
+    sa_prefetcher* prefetcher = (sa_prefetcher*)arg;
+
+    pthread_mutex_lock(&prefetcher->_lock);
+
+    while(!prefetcher->_stop)
+    {
+        if(prefetcher->_request == 0)
+        {
+            pthread_cond_wait(&prefetcher->_wake, &prefetcher->_lock);
+            continue;
+        }
+
+        size_t cap = prefetcher->_request;
+
+        pthread_mutex_unlock(&prefetcher->_lock);
+
+        sa_region* region = _sa_region_alloc(cap, prefetcher->_backing);
+        if(region != NULL)
+            _sa_region_prefault(region);
+
+        pthread_mutex_lock(&prefetcher->_lock);
+
+        if(prefetcher->_discard)
+        {
+            prefetcher->_discard = 0;
+            prefetcher->_request = 0;
+
+            pthread_mutex_unlock(&prefetcher->_lock);
+
+            if(region != NULL)
+                _sa_region_destroy(region, prefetcher->_backing);
+
+            pthread_mutex_lock(&prefetcher->_lock);
+            continue;
+        }
+
+        prefetcher->_ready = region;
+        prefetcher->_ready_cap = cap;
+        prefetcher->_request = 0;
+    }
+
+    pthread_mutex_unlock(&prefetcher->_lock);
+
+    return NULL;
+}
+
+/* Starts a background thread allocating regions from 'backing', which must
+ * outlive it.
+ *
+ * Return value:
+ * ON SUCCESS: address of the newly-allocated prefetcher;
+ * ON FAILURE: NULL. */
+static sa_prefetcher* _sa_prefetcher_create(const sa_backing* backing)
+{
+    sa_prefetcher* new = (sa_prefetcher*)calloc(1, sizeof(sa_prefetcher));
+    if(new == NULL) return NULL;
+
+    new->_backing = backing;
+
+    if(pthread_mutex_init(&new->_lock, NULL) != 0)
+    {
+        free(new);
+        return NULL;
+    }
+
+    if(pthread_cond_init(&new->_wake, NULL) != 0)
+    {
+        pthread_mutex_destroy(&new->_lock);
+        free(new);
+        return NULL;
+    }
+
+    if(pthread_create(&new->_thread, NULL, _sa_prefetcher_main, new) != 0)
+    {
+        pthread_cond_destroy(&new->_wake);
+        pthread_mutex_destroy(&new->_lock);
+        free(new);
+        return NULL;
+    }
+
+    return new;
+}
+
+/* Stops the background thread, waiting for the region being prepared, and
+ * destroys the prepared region. */
+static void _sa_prefetcher_destroy(sa_prefetcher* prefetcher)
+{
+    pthread_mutex_lock(&prefetcher->_lock);
+    prefetcher->_stop = 1;
+    pthread_cond_signal(&prefetcher->_wake);
+    pthread_mutex_unlock(&prefetcher->_lock);
+
+    pthread_join(prefetcher->_thread, NULL);
+
+    if(prefetcher->_ready != NULL)
+        _sa_region_destroy(prefetcher->_ready, prefetcher->_backing);
+
+    pthread_cond_destroy(&prefetcher->_wake);
+    pthread_mutex_destroy(&prefetcher->_lock);
+    free(prefetcher);
+}
+
+/* Asks for a region of 'cap' bytes, unless one is already prepared or being
+ * prepared. */
+static void _sa_prefetcher_request(sa_prefetcher* prefetcher, size_t cap)
+{
+    pthread_mutex_lock(&prefetcher->_lock);
+
+    if((prefetcher->_request == 0) && (prefetcher->_ready == NULL))
+    {
+        prefetcher->_request = cap;
+        pthread_cond_signal(&prefetcher->_wake);
+    }
+
+    pthread_mutex_unlock(&prefetcher->_lock);
+}
+
+/* Hands over the prepared region if it can hold 'size' bytes aligned to
+ * 'alignment', storing the capacity it was requested with in '*cap'. Does not
+ * wait for a region still being prepared. */
+static sa_region* _sa_prefetcher_take(sa_prefetcher* prefetcher, size_t size,
+        size_t alignment, size_t* cap)
+{
+    sa_region* region = NULL;
+
+    pthread_mutex_lock(&prefetcher->_lock);
+
+    sa_region* ready = prefetcher->_ready;
+
+    if((ready != NULL) && _sa_region_fits(ready,
+                _sa_region_aligned_offset(ready, alignment), size))
+    {
+        region = ready;
+        *cap = prefetcher->_ready_cap;
+        prefetcher->_ready = NULL;
+    }
+
+    pthread_mutex_unlock(&prefetcher->_lock);
+
+    return region;
+}
+
+/* Destroys the prepared region, and the region being prepared as soon as it
+ * is ready. Does not wait for the background thread. */
+static void _sa_prefetcher_cancel(sa_prefetcher* prefetcher)
+{
+    pthread_mutex_lock(&prefetcher->_lock);
+
+    sa_region* ready = prefetcher->_ready;
+    prefetcher->_ready = NULL;
+
+    if(prefetcher->_request != 0)
+        prefetcher->_discard = 1;
+
+    pthread_mutex_unlock(&prefetcher->_lock);
+
+    if(ready != NULL)
+        _sa_region_destroy(ready, prefetcher->_backing);
+}
+
+#else
+
+static sa_prefetcher* _sa_prefetcher_create(const sa_backing* backing)
+{ (void)backing; return NULL; }
+static void _sa_prefetcher_destroy(sa_prefetcher* prefetcher)
+{ (void)prefetcher; }
+static void _sa_prefetcher_request(sa_prefetcher* prefetcher, size_t cap)
+{ (void)prefetcher; (void)cap; }
+static sa_region* _sa_prefetcher_take(sa_prefetcher* prefetcher, size_t size,
+        size_t alignment, size_t* cap)
+{ (void)prefetcher; (void)size; (void)alignment; (void)cap; return NULL; }
+static void _sa_prefetcher_cancel(sa_prefetcher* prefetcher)
+{ (void)prefetcher; }
+
+#endif // _SA_HAVE_THREADS
+
+/* Returns the oldest epoch a reader is inside a section of, or SIZE_MAX if
+ * there is none. Memory released in an older epoch is no longer read. */
+static size_t _sa_epoch_oldest(sarena_epoch* epoch)
+{
+    // pairs with the fence in sarena_epoch_enter()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    size_t oldest = SIZE_MAX;
+
+    size_t i;
+    for(i = 0; i < epoch->_count; i++)
+    {
+        // pairs with the release in sarena_epoch_exit()
+        size_t entered = __atomic_load_n(&epoch->_readers[i]._epoch,
+                __ATOMIC_ACQUIRE);
+
+        if((entered != 0) && (entered < oldest))
+            oldest = entered;
+    }
+
+    return oldest;
+}
+
+static sarena_off_t _sa_off_make(size_t index, size_t offset)
+{
+    if((uint64_t)offset >> _SA_OFF_SHIFT) return SARENA_OFF_NULL;
+    if((uint64_t)index >= ((uint64_t)1 << (64 - _SA_OFF_SHIFT)) - 1)
+        return SARENA_OFF_NULL;
+
+    return ((sarena_off_t)(index + 1) << _SA_OFF_SHIFT) | offset;
+}
+
+/* Returns the first file offset at or after 'pos' at which the contents of
+ * 'region' can be placed. */
+static size_t _sa_image_region_offset(const sa_region* region, size_t pos)
+{
+    size_t want = (uintptr_t)region->_mem_pool % _SA_IMAGE_ALIGNMENT;
+    size_t have = pos % _SA_IMAGE_ALIGNMENT;
+
+    return pos + ((want + _SA_IMAGE_ALIGNMENT - have) % _SA_IMAGE_ALIGNMENT);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* If 'first' is not NULL, it becomes the first region of the arena instead of
+ * a newly-allocated one. */
+static int _sarena_init(sarena* arena, const sarena_options* opts,
+        sa_region* first)
+{
+    size_t region_cap = opts->region_cap;
+    size_t alignment = (opts->alignment != 0) ?
+        opts->alignment : SARENA_DEFAULT_ALIGNMENT;
+    size_t max_region_cap = (opts->max_region_cap != 0) ?
+        opts->max_region_cap : SIZE_MAX;
+
+    if(region_cap == 0) return 2;
+    if(!_sa_is_pow2(alignment)) return 2;
+    if(max_region_cap < region_cap) return 2;
+    if((opts->numa_policy == SARENA_NUMA_NODE) && (opts->numa_node < 0))
+        return 2;
+    if((opts->epoch != NULL) &&
+            ((opts->concurrent != 0) || (opts->reserve_cap != 0)))
+        return 2;
+
+    arena->_backing._alignment = alignment;
+    arena->_backing._huge_pages = opts->huge_pages;
+    arena->_backing._numa_node = -1;
+    arena->_backing._cache = opts->region_cache;
+    arena->_backing._allocator.alloc = NULL;
+    arena->_backing._allocator.free = NULL;
+    arena->_backing._allocator.ctx = NULL;
+
+    if(opts->numa_policy == SARENA_NUMA_NODE)
+        arena->_backing._numa_node = opts->numa_node;
+    else if(opts->numa_policy == SARENA_NUMA_LOCAL)
+        arena->_backing._numa_node = _sa_numa_local_node();
+
+#if !_SA_HAVE_LINUX_VM
+    arena->_backing._huge_pages = SARENA_HUGE_PAGES_NONE;
+    arena->_backing._numa_node = -1;
+#endif
+
+    if(opts->allocator != NULL)
+    {
+        arena->_backing._huge_pages = SARENA_HUGE_PAGES_NONE;
+        arena->_backing._numa_node = -1;
+        arena->_backing._cache = NULL;
+        arena->_backing._allocator = *opts->allocator;
+    }
+
+    arena->_region_cap = region_cap;
+    arena->_hot._alignment = alignment;
+    arena->_growth_factor = opts->growth_factor;
+    arena->_max_region_cap = max_region_cap;
+    arena->_next_cap = region_cap;
+    arena->_concurrent = (opts->concurrent != 0);
+#if defined(SARENA_DEBUG) || defined(SARENA_TRACE)
+    arena->_hot._slow = 1;
+#else
+    arena->_hot._slow = arena->_concurrent;
+#endif
+    arena->_id = __atomic_fetch_add(&_sa_next_arena_id, 1, __ATOMIC_RELAXED);
+    arena->_generation = 0;
+    arena->_releases = 0;
+    arena->_hot._curr = NULL;
+    arena->_spare_count = (opts->spare_regions == 0) ? 1 :
+        ((opts->spare_regions < SARENA_SPARE_MAX) ?
+         opts->spare_regions : SARENA_SPARE_MAX);
+    _sarena_clear_spares(arena);
+    arena->_hot._waste = 0;
+    arena->_hot._alloc_count = 0;
+    arena->_peak = 0;
+    arena->_cleanups = NULL;
+    arena->_debug = NULL;
+    arena->_trim_window = (opts->trim_window < SARENA_TRIM_WINDOW_MAX) ?
+        opts->trim_window : SARENA_TRIM_WINDOW_MAX;
+    arena->_trim_pos = 0;
+    memset(arena->_trim_history, 0, sizeof(arena->_trim_history));
+    arena->_vm_base = NULL;
+    arena->_vm_size = 0;
+    arena->_vm_commit_size = 0;
+    arena->_vm_pool_cap = 0;
+    _sa_region_list_init(&arena->_regions);
+
+    arena->_in_buffer = 0;
+    arena->_epoch = opts->epoch;
+    arena->_limbo_count = 0;
+    arena->_prefetch_percent = (opts->prefetch_percent < 100) ?
+        opts->prefetch_percent : 99;
+    arena->_prefetcher = NULL;
+
+    if(arena->_concurrent || (opts->reserve_cap != 0))
+        arena->_prefetch_percent = 0;
+
+    if(opts->reserve_cap != 0)
+        return _sarena_init_vm(arena, opts->reserve_cap);
+
+    if(first != NULL)
+    {
+        arena->_regions._head = first;
+        arena->_regions._tail = first;
+        arena->_regions._count = 1;
+    }
+    else
+    {
+        int status = _sa_region_list_push_back(&arena->_regions, region_cap,
+                &arena->_backing);
+        if(status != 0) return 1;
+    }
+
+    arena->_hot._curr = arena->_regions._head;
+    _sarena_grow(arena);
+    _sarena_arm_prefetch(arena);
+
+    if((arena->_prefetch_percent != 0) && (opts->prefetch_thread != 0) &&
+            (opts->allocator == NULL) && _SA_HAVE_THREADS)
+    {
+        arena->_prefetcher = _sa_prefetcher_create(&arena->_backing);
+
+        if(arena->_prefetcher == NULL)
+        {
+            if(first == NULL)
+                _sa_region_list_pop_front(&arena->_regions, &arena->_backing);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Reserves the address space of a VM arena, places its only region at the
+ * start of it and commits the first 'region_cap' bytes. */
+static int _sarena_init_vm(sarena* arena, size_t reserve_cap)
+{
+    const sa_backing* backing = &arena->_backing;
+
+    size_t huge_page_size = _sa_huge_page_size(backing->_huge_pages);
+    size_t page_size = (huge_page_size != 0) ?
+        huge_page_size : _sa_vm_page_size();
+    if(page_size == 0) return 3;
+
+    size_t pool_offset = _sa_align_up(_SA_REGION_HEADER_SIZE, arena->_hot._alignment);
+    size_t commit_size = _sa_align_up(arena->_region_cap, page_size);
+
+    if((reserve_cap > SIZE_MAX - pool_offset - page_size) ||
+            (commit_size < arena->_region_cap))
+        return 2;
+
+    size_t vm_size = _sa_align_up(pool_offset + reserve_cap, page_size);
+
+    char* vm_base = (char*)_sa_vm_reserve_aligned(vm_size, page_size);
+    if(vm_base == NULL) return 1;
+
+    _sa_pages_advise(vm_base, vm_size, backing->_huge_pages,
+            backing->_numa_node);
+
+    if(commit_size > vm_size)
+        commit_size = vm_size;
+
+    if((pool_offset > vm_size) ||
+            (_sa_vm_commit(vm_base, commit_size) != 0))
+    {
+        _sa_vm_release(vm_base, vm_size);
+        return 1;
+    }
+
+    sa_region* region = (sa_region*)(vm_base + pool_offset -
+            _SA_REGION_HEADER_SIZE);
+
+    region->_used_cap = 0;
+    region->_total_cap = commit_size - pool_offset;
+    region->_fast_cap = region->_total_cap;
+    region->_dirty_cap = 0;
+    region->_floor_releases = SIZE_MAX;
+    region->_next = NULL;
+    region->_mem_block = vm_base;
+    region->_block_size = vm_size;
+    region->_origin = _SA_REGION_VM;
+    _sa_poison(region->_mem_pool, region->_total_cap);
+
+    arena->_vm_base = vm_base;
+    arena->_vm_size = vm_size;
+    arena->_vm_commit_size = commit_size;
+    arena->_vm_pool_cap = vm_size - pool_offset;
+
+    arena->_regions._head = region;
+    arena->_regions._tail = region;
+    arena->_regions._count = 1;
+    arena->_hot._curr = region;
+
+    return 0;
+}
+
+/* Commits enough pages for the memory pool of a VM arena to hold 'pool_cap'
+ * bytes. May be called by multiple threads at once - committing the same
+ * pages more than once is harmless, and '_total_cap' only ever grows. */
+static int _sarena_vm_commit(sarena* arena, size_t pool_cap)
+{
+    sa_region* region = arena->_regions._head;
+    size_t pool_offset = (size_t)(region->_mem_pool - arena->_vm_base);
+
+    if(pool_cap > arena->_vm_pool_cap) return 1;
+
+    size_t new_commit = _sa_align_up(pool_offset + pool_cap,
+            arena->_vm_commit_size);
+    if((new_commit > arena->_vm_size) || (new_commit < pool_offset + pool_cap))
+        new_commit = arena->_vm_size;
+
+    size_t total_cap = __atomic_load_n(&region->_total_cap, __ATOMIC_ACQUIRE);
+
+    while(pool_offset + total_cap < new_commit)
+    {
+        size_t committed = pool_offset + total_cap;
+
+        if(_sa_vm_commit(arena->_vm_base + committed,
+                    new_commit - committed) != 0)
+            return 1;
+
+        if(__atomic_compare_exchange_n(&region->_total_cap, &total_cap,
+                    new_commit - pool_offset, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&region->_fast_cap, new_commit - pool_offset,
+                    __ATOMIC_RELAXED);
+            _sa_poison(arena->_vm_base + committed, new_commit - committed);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Checks if the block at 'ptr' of 'size' bytes is the most recent allocation
+ * of the region. Any later allocation would start at the next multiple of the
+ * arena's alignment at the earliest, so padding up to there may follow the
+ * block. The used capacity of the region is stored in 'used_cap'. */
+static int _sarena_region_top_is(const sa_region* region, const char* ptr,
+        size_t size, size_t alignment, size_t* used_cap)
+{
+    if(region == NULL) return 0;
+
+    uintptr_t pool = (uintptr_t)region->_mem_pool;
+    uintptr_t block = (uintptr_t)ptr;
+    *used_cap = __atomic_load_n(&region->_used_cap, __ATOMIC_RELAXED);
+
+    if((block < pool) || (block - pool > *used_cap)) return 0;
+
+    size_t end = (size_t)(block - pool);
+    if(size > *used_cap - end) return 0;
+    end += size;
+
+    return *used_cap <= _sa_align_up(end, alignment);
+}
+
+/* Moves the end of the most recent allocation of a region, so the block at
+ * 'ptr' becomes 'new_size' bytes large. Allocations are served from the active
+ * region or from one of the spare ones, so only those can hold the block.
+ *
+ * Return value:
+ * ON SUCCESS: 0;
+ * ON FAILURE: 1. */
+static int _sarena_resize_last(sarena* arena, void* ptr, size_t old_size,
+        size_t new_size)
+{
+#ifdef SARENA_DEBUG
+    // the redzone follows the block
+    (void)arena; (void)ptr; (void)old_size; (void)new_size;
+    return 1;
+#endif
+
+    size_t alignment = arena->_hot._alignment;
+    size_t old_end = 0;
+
+    sa_region* region = __atomic_load_n(&arena->_hot._curr, __ATOMIC_ACQUIRE);
+
+    if(!_sarena_region_top_is(region, ptr, old_size, alignment, &old_end))
+    {
+        size_t i;
+        for(i = 0; i < arena->_spare_count; i++)
+        {
+            region = arena->_spares[i];
+            if(_sarena_region_top_is(region, ptr, old_size, alignment,
+                        &old_end))
+                break;
+        }
+
+        if(i == arena->_spare_count) return 1;
+    }
+
+    size_t offset = (size_t)((char*)ptr - region->_mem_pool);
+    if(new_size > SIZE_MAX - offset) return 1;
+
+    size_t new_end = offset + new_size;
+
+    if(new_end > __atomic_load_n(&region->_total_cap, __ATOMIC_ACQUIRE))
+    {
+        if((arena->_vm_base == NULL) || (_sarena_vm_commit(arena, new_end) != 0))
+            return 1;
+    }
+
+    if(new_end < old_end)
+        _sa_region_mark_dirty(region);
+
+    if(arena->_concurrent) // fails if another thread allocated meanwhile
+    {
+        return __atomic_compare_exchange_n(&region->_used_cap, &old_end,
+                new_end, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ? 0 : 1;
+    }
+
+    region->_used_cap = new_end;
+
+    return 0;
+}
+
+/* Runs the cleanup callbacks registered after 'stop', most recent first. Each
+ * one is unlinked before it runs. Callbacks registered by a running callback
+ * run next. */
+static void _sarena_run_cleanups(sarena* arena, sa_cleanup* stop)
+{
+    while((arena->_cleanups != NULL) && (arena->_cleanups != stop))
+    {
+        sa_cleanup* cleanup = arena->_cleanups;
+
+        arena->_cleanups = cleanup->_prev;
+        cleanup->_fn(cleanup->_ctx);
+    }
+}
+
+#ifdef SARENA_DEBUG
+
+/* Allocates the block together with its header and redzone. The block is
+ * placed so that the header ends right where it starts. */
+static void* _sarena_debug_malloc(sarena* arena, size_t size,
+        size_t alignment)
+{
+    if(alignment < _SA_MALLOC_ALIGNMENT)
+        alignment = _SA_MALLOC_ALIGNMENT;
+
+    size_t header = _sa_align_up(sizeof(sa_debug_record), alignment);
+
+    if(size > SIZE_MAX - header - SARENA_DEBUG_REDZONE)
+        return NULL;
+
+    size_t total = header + size + SARENA_DEBUG_REDZONE;
+
+    char* block = (char*)_sarena_malloc_plain(arena, total, alignment);
+    if(block == NULL) return NULL;
+
+    char* ptr = block + header;
+    sa_debug_record* record = (sa_debug_record*)ptr - 1;
+
+    _sa_unpoison(block, total);
+
+    record->_size = size;
+    record->_site = _sa_call_site;
+    record->_canary = (uintptr_t)record ^ _SA_DEBUG_CANARY;
+    memset(ptr + size, _SA_DEBUG_REDZONE_BYTE, SARENA_DEBUG_REDZONE);
+
+    if(arena->_concurrent)
+    {
+        sa_debug_record* prev = __atomic_load_n(&arena->_debug,
+                __ATOMIC_RELAXED);
+        do record->_prev = prev;
+        while(!__atomic_compare_exchange_n(&arena->_debug, &prev, record,
+                    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    else
+    {
+        record->_prev = arena->_debug;
+        arena->_debug = record;
+    }
+
+    _sa_poison(block, header);
+    _sa_poison(ptr + size, SARENA_DEBUG_REDZONE);
+
+    return ptr;
+}
+
+/* Checks the allocations made after 'stop', most recent first, and forgets
+ * them. Their memory is poisoned again by _sa_region_rewind(). */
+static void _sarena_debug_drop(sarena* arena, sa_debug_record* stop)
+{
+    while((arena->_debug != NULL) && (arena->_debug != stop))
+    {
+        sa_debug_record* record = arena->_debug;
+
+        _sarena_debug_check(record);
+        arena->_debug = record->_prev;
+    }
+}
+
+/* Aborts the program if the header or the redzone of the block have been
+ * overwritten. */
+static void _sarena_debug_check(const sa_debug_record* record)
+{
+    const unsigned char* ptr = (const unsigned char*)(record + 1);
+
+    _sa_unpoison((void*)record, sizeof(sa_debug_record));
+
+    if(record->_canary != ((uintptr_t)record ^ _SA_DEBUG_CANARY))
+    {
+        fprintf(stderr, "sarena: memory right before the block at %p was "
+                "overwritten\n", (void*)ptr);
+        abort();
+    }
+
+    _sa_unpoison((void*)(ptr + record->_size), SARENA_DEBUG_REDZONE);
+
+    size_t i;
+    for(i = 0; i < SARENA_DEBUG_REDZONE; i++)
+    {
+        if(ptr[record->_size + i] != _SA_DEBUG_REDZONE_BYTE)
+        {
+            fprintf(stderr, "sarena: memory past the end of the %zu-byte "
+                    "block at %p, allocated from %p, was overwritten\n",
+                    record->_size, (void*)ptr, record->_site);
+            abort();
+        }
+    }
+}
+
+/* Poisons everything but the live blocks. */
+static void _sarena_debug_repoison(sarena* arena)
+{
+    sa_region* it = arena->_regions._head;
+
+    for(; it != NULL; it = it->_next)
+        _sa_poison(it->_mem_pool, it->_total_cap);
+
+    const sa_debug_record* record = arena->_debug;
+
+    while(record != NULL)
+    {
+        _sa_unpoison((void*)record, sizeof(sa_debug_record));
+
+        const sa_debug_record* prev = record->_prev;
+        size_t size = record->_size;
+
+        _sa_poison((void*)record, sizeof(sa_debug_record));
+        _sa_unpoison((void*)(record + 1), size);
+
+        record = prev;
+    }
+}
+
+#else
+
+static void _sarena_debug_drop(sarena* arena, sa_debug_record* stop)
+{ (void)arena; (void)stop; }
+static void _sarena_debug_repoison(sarena* arena)
+{ (void)arena; }
+
+#endif // SARENA_DEBUG
+
+/* Zeroes a block returned by _sarena_malloc(), skipping the part which is
+ * known to be zero. The block was carved out of the active region, a spare
+ * one or a region inserted right after the active one - if it is not found in
+ * any of them, it is cleared entirely. */
+static void _sarena_zero_block(sarena* arena, void* ptr, size_t size)
+{
+    // pairs with the release of the CAS in _sarena_resize_last()
+    if(arena->_concurrent)
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    sa_region* curr = __atomic_load_n(&arena->_hot._curr, __ATOMIC_ACQUIRE);
+    sa_region* candidates[SARENA_SPARE_MAX + 2] = { curr, NULL };
+
+    if(curr != NULL)
+        candidates[1] = __atomic_load_n(&curr->_next, __ATOMIC_ACQUIRE);
+
+    size_t count = 2;
+    size_t i;
+    for(i = 0; i < arena->_spare_count; i++)
+        candidates[count++] = arena->_spares[i];
+
+    uintptr_t block = (uintptr_t)ptr;
+
+    for(i = 0; i < count; i++)
+    {
+        sa_region* region = candidates[i];
+        if(region == NULL) continue;
+
+        uintptr_t pool = (uintptr_t)region->_mem_pool;
+        size_t total_cap = __atomic_load_n(&region->_total_cap,
+                __ATOMIC_ACQUIRE);
+
+        if((block < pool) || (block - pool > total_cap) ||
+                (size > total_cap - (block - pool)))
+            continue;
+
+        size_t offset = (size_t)(block - pool);
+        size_t dirty_cap = __atomic_load_n(&region->_dirty_cap,
+                __ATOMIC_RELAXED);
+
+        if(offset < dirty_cap)
+            memset(ptr, 0, (size < dirty_cap - offset) ?
+                    size : (dirty_cap - offset));
+
+        return;
+    }
+
+    memset(ptr, 0, size);
+}
+
+/* Releases all allocations, on behalf of the public function which set the
+ * call site. */
+static void _sarena_rewind(sarena* arena)
+{
+    if(arena->_regions._count == 0) 
+        return;
+
+    // deferred callbacks run once the readers are done with the memory
+    if(arena->_epoch == NULL)
+        _sarena_run_cleanups(arena, NULL);
+    _sarena_debug_drop(arena, NULL);
+
+    size_t used = _sarena_sample_peak(arena);
+
+    _SA_TRACE(arena, SARENA_TRACE_REWIND, rewind, NULL, used);
+
+    if(arena->_epoch != NULL)
+        _sarena_defer(arena, 0);
+    else
+    {
+        // the regions after the active one are empty already
+        sa_region* end = arena->_hot._curr->_next;
+        sa_region* it = arena->_regions._head;
+
+        for(; it != end; it = it->_next)
+            _sa_region_rewind(it, 0);
+
+        // start rewinding from the first region
+        arena->_hot._curr = arena->_regions._head;
+    }
+
+    _sarena_arm_prefetch(arena);
+    _sarena_clear_spares(arena);
+
+    arena->_hot._waste = 0;
+    __atomic_fetch_add(&arena->_releases, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&arena->_generation, 1, __ATOMIC_RELAXED);
+
+    if(arena->_trim_window != 0)
+        _sarena_auto_trim(arena, used);
+}
+
+/* Returns the number of bytes currently allocated from the arena. Only the
+ * regions up to the active one can hold allocations, so this takes time
+ * proportional to the number of regions in use. */
+static size_t _sarena_used(const sarena* arena)
+{
+    const sa_region* curr = __atomic_load_n(&arena->_hot._curr,
+            __ATOMIC_ACQUIRE);
+    if(curr == NULL) return 0;
+
+    const sa_region* end = __atomic_load_n(&curr->_next, __ATOMIC_ACQUIRE);
+    const sa_region* it = arena->_regions._head;
+    size_t used = 0;
+
+    for(; it != end; it = it->_next)
+        used += _sa_region_used(it);
+
+    return used;
+}
+
+/* Usage only grows between rewinds, so sampling it right before memory is
+ * released yields the true peak. */
+static size_t _sarena_sample_peak(sarena* arena)
+{
+    size_t used = _sarena_used(arena);
+
+    if(used > arena->_peak)
+        arena->_peak = used;
+
+    return used;
+}
+
+/* Records the usage before a rewind and trims the arena to the highest usage
+ * within the window. */
+static void _sarena_auto_trim(sarena* arena, size_t used)
+{
+    arena->_trim_history[arena->_trim_pos] = used;
+    arena->_trim_pos = (arena->_trim_pos + 1) % arena->_trim_window;
+
+    size_t keep_cap = 0;
+
+    size_t i;
+    for(i = 0; i < arena->_trim_window; i++)
+    {
+        if(arena->_trim_history[i] > keep_cap)
+            keep_cap = arena->_trim_history[i];
+    }
+
+    sarena_trim(arena, keep_cap);
+}
+
+static void _sarena_trim_vm(sarena* arena, size_t keep_cap)
+{
+    sa_region* region = arena->_regions._head;
+    size_t pool_offset = (size_t)(region->_mem_pool - arena->_vm_base);
+    size_t committed = pool_offset + region->_total_cap;
+
+    if(keep_cap < region->_used_cap)
+        keep_cap = region->_used_cap;
+
+    if(keep_cap > arena->_vm_pool_cap)
+        return;
+
+    size_t new_commit = _sa_align_up(pool_offset + keep_cap,
+            arena->_vm_commit_size);
+
+    if(new_commit < arena->_vm_commit_size) // always keep the first commit
+        new_commit = arena->_vm_commit_size;
+
+    if(new_commit >= committed) return;
+
+    _sa_unpoison(arena->_vm_base + new_commit, committed - new_commit);
+    _sa_vm_decommit(arena->_vm_base + new_commit, committed - new_commit);
+    region->_total_cap = new_commit - pool_offset;
+    region->_fast_cap = region->_total_cap;
+
+    // decommitted pages read back as zero once committed again
+    _sa_region_mark_dirty(region);
+    if(region->_dirty_cap > region->_total_cap)
+        region->_dirty_cap = region->_total_cap;
+}
+
+static void _sarena_count_alloc(sarena* arena, size_t count)
+{
+#ifdef SARENA_STATS
+    if(arena->_concurrent)
+        __atomic_fetch_add(&arena->_hot._alloc_count, count, __ATOMIC_RELAXED);
+    else
+        arena->_hot._alloc_count += count;
+#else
+    (void)arena; (void)count;
+#endif
+}
+
+/* Returns whether the 'size' bytes at 'ptr' were allocated since the last
+ * rewind or reset and never released by sarena_rewind_to() since. If 'hint'
+ * is not NULL, '*hint' is the region found last, which is tried first, and is
+ * updated. */
+static int _sarena_holds(const sarena* arena, const void* ptr, size_t size,
+        const sa_region** hint)
+{
+    uintptr_t addr = (uintptr_t)ptr;
+    const sa_region* region = (hint != NULL) ? *hint : NULL;
+
+    if((region == NULL) || (addr < (uintptr_t)region->_mem_pool) ||
+            (addr - (uintptr_t)region->_mem_pool >= region->_total_cap))
+    {
+        // only the regions up to the active one are used
+        const sa_region* curr = __atomic_load_n(&arena->_hot._curr,
+                __ATOMIC_ACQUIRE);
+        const sa_region* end = __atomic_load_n(&curr->_next,
+                __ATOMIC_ACQUIRE);
+
+        for(region = arena->_regions._head; region != end;
+                region = region->_next)
+        {
+            if((addr >= (uintptr_t)region->_mem_pool) &&
+                    (addr - (uintptr_t)region->_mem_pool < region->_total_cap))
+                break;
+        }
+
+        if(region == end) return 0;
+
+        if(hint != NULL) *hint = region;
+    }
+
+    size_t offset = addr - (uintptr_t)region->_mem_pool;
+    size_t used = _sa_region_used(region);
+
+    // memory released since may have been handed out again
+    if((region->_floor_releases == arena->_releases) &&
+            (region->_floor_cap < used))
+        used = region->_floor_cap;
+
+    return (offset <= used) && (size <= used - offset);
+}
+
+/* Rewinds 'region' for sarena_rewind_to(), lowering its floor. */
+static void _sarena_rewind_region_to(sarena* arena, sa_region* region,
+        size_t used_cap)
+{
+    if((region->_floor_releases != arena->_releases) ||
+            (used_cap < region->_floor_cap))
+    {
+        region->_floor_cap = used_cap;
+        region->_floor_releases = arena->_releases;
+    }
+
+    _sa_region_rewind(region, used_cap);
+}
+
+/* Catches up with the rewinds of the pool's arena. After a rewind or reset,
+ * the pool starts over. After sarena_rewind_to(), it keeps the rest of its
+ * chunk and its free slots as long as the arena still holds them. A released
+ * slot may have been overwritten, link included, so the free list is cut at
+ * the first one - the slots after it are only reused after the next rewind.
+ *
+ * Return value:
+ * 0, if the pool was up to date;
+ * 1, if the arena was rewound to a mark;
+ * 2, if all slots were released. */
+static int _sarena_pool_sync(sarena_pool* pool)
+{
+    sarena* arena = pool->_arena;
+    size_t generation = __atomic_load_n(&arena->_generation, __ATOMIC_RELAXED);
+
+    if(pool->_generation == generation) return 0;
+
+    pool->_generation = generation;
+
+    size_t releases = __atomic_load_n(&arena->_releases, __ATOMIC_RELAXED);
+
+    if(pool->_releases != releases)
+    {
+        pool->_releases = releases;
+        pool->_free = NULL;
+        pool->_pos = NULL;
+        pool->_end = NULL;
+
+        return 2;
+    }
+
+    const sa_region* hint = NULL;
+
+    if((pool->_pos != pool->_end) && !_sarena_holds(arena, pool->_pos,
+                (size_t)(pool->_end - pool->_pos), &hint))
+    {
+        pool->_pos = NULL;
+        pool->_end = NULL;
+    }
 
-void* sarena_malloc(sarena* arena, size_t size);
+    void* slot = pool->_free;
+    void* last = NULL; // last slot kept
 
-/* -------------------------------------------------------------------------- */
+    while((slot != NULL) && _sarena_holds(arena, slot, pool->_slot_size,
+                &hint))
+    {
+        last = slot;
 
-/* This function allocates a zero-initialized memory block of the given size 
- * from the SArena. It behaves similarly to sarena_malloc, but ensures that
- * the allocated memory is filled with zeros.
+        _sa_unpoison(slot, sizeof(void*));
+        memcpy(&slot, slot, sizeof(void*));
+        _sa_poison(last, sizeof(void*));
+    }
 
-The return value and possible errors are the same as those for sarena_malloc. */
+    if(last == NULL)
+        pool->_free = NULL;
+    else if(slot != NULL)
+    {
+        void* none = NULL;
 
-void* sarena_calloc(sarena* arena, size_t size);
+        _sa_unpoison(last, sizeof(void*));
+        memcpy(last, &none, sizeof(void*));
+        _sa_poison(last, sizeof(void*));
+    }
 
-/* -------------------------------------------------------------------------- */
+    return 1;
+}
 
-/* This function resets the arena by marking all allocated memory within
- * existing regions as available for reuse. It does not free any memory
- * but instead sets all regions' used capacity to zero. 
- * If multiple regions exist, the arena enters 'rewind mode' allowing
- * previously allocated regions to be reused in order. */
+/* Computes the capacity of the region following the one of '_next_cap'
+ * bytes, according to the arena's growth policy. */
+static void _sarena_grow(sarena* arena)
+{
+    size_t factor = arena->_growth_factor;
+    size_t cap = __atomic_load_n(&arena->_next_cap, __ATOMIC_RELAXED);
 
-void sarena_rewind(sarena* arena);
+    if(factor <= 1) return;
 
-/* -------------------------------------------------------------------------- */
+    cap = (cap > arena->_max_region_cap / factor) ?
+        arena->_max_region_cap : (cap * factor);
 
-/* This function deallocates all allocated regions except the first one.
- * This means that all memory occupied by those regions will be freed.
- * The first region will be reset, making its memory available for reuse.
- * After this call, the arena will be in the same state as immediately
- * after sarena_init(). */
+    __atomic_store_n(&arena->_next_cap, cap, __ATOMIC_RELAXED);
+}
 
-void sarena_reset(sarena* arena);
+/* Returns the offset inside 'region's memory pool at which an allocation
+ * aligned to 'alignment' would start. */
+static inline size_t _sa_region_aligned_offset(const sa_region* region,
+        size_t alignment)
+{
+    uintptr_t top = (uintptr_t)(region->_mem_pool + region->_used_cap);
 
-#ifdef __cplusplus
+    return region->_used_cap + (_sa_align_up(top, alignment) - top);
 }
-#endif
-
-#endif // _SARENA_H_
 
-/* -------------------------------------------------------------------------- */
-/* IMPLEMENTATION */
-/* -------------------------------------------------------------------------- */
+static inline int _sa_region_fits(const sa_region* region, size_t offset,
+        size_t size)
+{
+    return (offset <= region->_total_cap) &&
+        (size <= region->_total_cap - offset);
+}
 
-#ifdef SARENA_IMPLEMENTATION
+/* Returns the capacity of a fresh region able to hold an allocation of 'size'
+ * bytes aligned to 'alignment', or 0 on overflow. Region pools are aligned to
+ * the arena's alignment, so at most 'alignment - arena->_hot._alignment' bytes of
+ * padding are needed. */
+static inline size_t _sarena_fresh_cap(const sarena* arena, size_t size,
+        size_t alignment)
+{
+    size_t pad = alignment - arena->_hot._alignment;
 
-#include <string.h>
-#include <stdlib.h>
+    if(size > SIZE_MAX - pad) return 0;
 
-/* -------------------------------------------------------------------------- */
+    size_t cap = size + pad;
 
-typedef struct sa_region sa_region;
-typedef struct sa_region_list sa_region_list;
+    return (cap > arena->_next_cap) ? cap : arena->_next_cap;
+}
 
-struct sa_region
+static void* _sarena_malloc(sarena* arena, size_t size, size_t alignment)
 {
-    size_t _used_cap;
-    size_t _total_cap;
-    char* _mem_pool;
+    if(size == 0)
+        return NULL;
 
-    sa_region* _next;
-};
+#ifdef SARENA_DEBUG
+    void* alloc_addr = _sarena_debug_malloc(arena, size, alignment);
+#else
+    void* alloc_addr = _sarena_malloc_plain(arena, size, alignment);
+#endif
 
-static sa_region* _sa_region_alloc(size_t total_cap);
-static void _sa_region_destroy(sa_region* region);
+    if(alloc_addr != NULL)
+        _SA_TRACE(arena, SARENA_TRACE_ALLOC, alloc, alloc_addr, size);
 
-/* -------------------------------------------------------------------------- */
+    return alloc_addr;
+}
 
-struct sa_region_list
+static void* _sarena_malloc_plain(sarena* arena, size_t size,
+        size_t alignment)
 {
-    sa_region* _head;
-    sa_region* _tail;
+    if(arena->_concurrent)
+        return _sarena_malloc_concurrent(arena, size, alignment);
 
-    size_t _count;
-};
+    sa_region* region = arena->_hot._curr;
 
-static void _sa_region_list_init(sa_region_list* list);
-static int _sa_region_list_push_back(sa_region_list* list, size_t total_cap);
-static void _sa_region_list_pop_front(sa_region_list* list);
+    size_t offset = _sa_region_aligned_offset(region, alignment);
 
-/* -------------------------------------------------------------------------- */
-/* -------------------------------------------------------------------------- */
-/* -------------------------------------------------------------------------- */
+    // not enough memory in current region
+    if(!_sa_region_fits(region, offset, size))
+    {
+        region = _sarena_find_region(arena, size, alignment);
+        if(region == NULL) return NULL;
 
-struct sarena
-{
-    sa_region_list _regions;
-    size_t _region_cap;
+        offset = _sa_region_aligned_offset(region, alignment);
+    }
 
-    sa_region* _rewind_it;
-};
+    arena->_hot._waste += offset - region->_used_cap;
+
+    void* alloc_addr = region->_mem_pool + offset;
+    region->_used_cap = offset + size;
+
+    if((region == arena->_hot._curr) && (region->_used_cap > region->_fast_cap))
+        _sarena_prefetch(arena);
 
-static sa_region* _sa_region_alloc(size_t total_cap)
+    return alloc_addr;
+}
+
+/* Finds a region able to hold 'size' bytes aligned to 'alignment' when the
+ * current region cannot. In order, this:
+ *
+ * 1) commits more pages, if the arena is backed by virtual memory;
+ * 2) tries the spare regions - the regions with the most free space left
+ *    among the ones abandoned since the last rewind - preferring the one with
+ *    the least free space that can hold the allocation;
+ * 3) advances to the next region, if it is large enough. The next region is
+ *    always empty, as it is either freshly allocated or was emptied by
+ *    rewinding;
+ * 4) inserts a new region large enough to hold the allocation after the
+ *    current one.
+ *
+ * When the current region is abandoned, it is retired to the spare slots. */
+static sa_region* _sarena_find_region(sarena* arena, size_t size,
+        size_t alignment)
 {
-    sa_region* new_region = (sa_region*)malloc(sizeof(sa_region));
+    sa_region* curr = arena->_hot._curr;
 
-    if(new_region == NULL) return NULL;
+    if(arena->_vm_base != NULL)
+    {
+        size_t offset = _sa_region_aligned_offset(curr, alignment);
 
-    new_region->_next = NULL;
-    new_region->_total_cap = 0;
-    new_region->_used_cap = 0;
+        if((size > SIZE_MAX - offset) ||
+                (_sarena_vm_commit(arena, offset + size) != 0))
+            return NULL;
 
-    new_region->_mem_pool = malloc(total_cap);
+        return curr;
+    }
+
+    sa_region* spare = _sarena_find_spare(arena, size, alignment);
+    if(spare != NULL) return spare;
 
-    if(new_region->_mem_pool == NULL)
+    sa_region* next = curr->_next;
+
+    // regions set aside may have been released by the readers since
+    if((next == NULL) && (arena->_limbo_count != 0))
     {
-        free(new_region);
-        return NULL;
+        _sarena_reclaim(arena, 0);
+
+        curr = arena->_hot._curr; // in case a cleanup callback allocated
+        next = curr->_next;
     }
 
-    new_region->_total_cap = total_cap;
+    if((next == NULL) || !_sa_region_fits(next,
+                _sa_region_aligned_offset(next, alignment), size))
+    {
+        size_t cap = _sarena_fresh_cap(arena, size, alignment);
+        if(cap == 0) return NULL;
+
+        size_t prepared_cap = 0;
+        sa_region* prepared = NULL;
 
-    return new_region;
+        if((arena->_prefetcher != NULL) && (cap == arena->_next_cap))
+            prepared = _sa_prefetcher_take(arena->_prefetcher, size,
+                    alignment, &prepared_cap);
+
+        if(prepared != NULL)
+        {
+            _sa_region_list_link_after(&arena->_regions, curr, prepared);
+            cap = prepared_cap;
+        }
+        else
+        {
+            int status = _sa_region_list_insert_after(&arena->_regions,
+                    curr, cap, &arena->_backing);
+            if(status != 0)
+                return NULL;
+        }
+
+        _SA_TRACE(arena, SARENA_TRACE_REGION, region, curr->_next->_mem_pool,
+                curr->_next->_total_cap);
+
+        // dedicated regions do not advance the growth
+        if(cap == arena->_next_cap)
+            _sarena_grow(arena);
+    }
+
+    _sarena_retire(arena, curr);
+    arena->_hot._curr = curr->_next;
+    _sarena_arm_prefetch(arena);
+
+    return arena->_hot._curr;
 }
 
-static void _sa_region_destroy(sa_region* region)
+/* Returns the spare region with the least free space left which can hold
+ * 'size' bytes aligned to 'alignment', or NULL if there is none. Placing
+ * allocations in the tightest gap keeps the larger gaps for larger
+ * allocations. */
+static sa_region* _sarena_find_spare(const sarena* arena, size_t size,
+        size_t alignment)
 {
-    region->_next = NULL;
-    region->_total_cap = 0;
-    region->_used_cap = 0;
+    sa_region* best = NULL;
+    size_t best_free = SIZE_MAX;
+
+    size_t i;
+    for(i = 0; i < arena->_spare_count; i++)
+    {
+        sa_region* spare = arena->_spares[i];
+        if(spare == NULL) continue;
 
-    if(region->_mem_pool != NULL) 
-        free(region->_mem_pool);
-    region->_mem_pool = NULL;
+        size_t offset = _sa_region_aligned_offset(spare, alignment);
+        if(!_sa_region_fits(spare, offset, size)) continue;
 
-    free(region);
+        size_t free_cap = spare->_total_cap - offset;
+        if(free_cap < best_free)
+        {
+            best = spare;
+            best_free = free_cap;
+        }
+    }
+
+    return best;
 }
 
-/* -------------------------------------------------------------------------- */
+/* Stores the abandoned 'region' in the spare slot holding the least free
+ * space, if 'region' has more free space left. The free space of whichever
+ * region is dropped is accounted as waste. */
+static void _sarena_retire(sarena* arena, sa_region* region)
+{
+    size_t region_free = region->_total_cap - region->_used_cap;
 
-static void _sa_region_list_init(sa_region_list* list)
+    size_t slot = 0;
+    size_t slot_free = SIZE_MAX;
+
+    size_t i;
+    for(i = 0; i < arena->_spare_count; i++)
+    {
+        sa_region* spare = arena->_spares[i];
+        size_t spare_free = (spare != NULL) ?
+            (spare->_total_cap - spare->_used_cap) : 0;
+
+        if(spare_free < slot_free)
+        {
+            slot = i;
+            slot_free = spare_free;
+        }
+    }
+
+    if(region_free > slot_free)
+    {
+        arena->_spares[slot] = region;
+        arena->_hot._waste += slot_free;
+    }
+    else arena->_hot._waste += region_free;
+}
+
+static void _sarena_clear_spares(sarena* arena)
 {
-    list->_count = 0;
-    list->_head = NULL;
-    list->_tail = NULL;
+    size_t i;
+    for(i = 0; i < SARENA_SPARE_MAX; i++)
+        arena->_spares[i] = NULL;
 }
 
-static int _sa_region_list_push_back(sa_region_list* list, size_t total_cap)
+/* Sets the regions used since the last rewind aside, together with the
+ * cleanup callbacks, until the readers of the arena's epoch domain are done
+ * with them, and makes the arena allocate from the first remaining region.
+ * If 'release' is not 0, the remaining regions are freed and the regions set
+ * aside are freed instead of reused, which also holds for the ones set aside
+ * before. If no region is left, a new one is allocated, and if that fails,
+ * this spins until the readers have left the oldest batch, as the arena must
+ * always have a region to allocate from. */
+static void _sarena_defer(sarena* arena, int release)
 {
-    sa_region* new = _sa_region_alloc(total_cap);
-    if(new == NULL) return 1;
+    sa_region_list* list = &arena->_regions;
+    sa_region* curr = arena->_hot._curr;
+
+    sa_limbo batch = {
+        ._head = list->_head,
+        ._tail = curr,
+        ._count = 1,
+        ._cleanups = arena->_cleanups,
+        ._release = release
+    };
+
+    sa_region* it = list->_head;
+    for(; it != curr; it = it->_next)
+        batch._count++;
 
+    size_t first_cap = list->_head->_total_cap;
+
+    list->_head = curr->_next;
     if(list->_head == NULL)
+        list->_tail = NULL;
+    list->_count -= batch._count;
+
+    curr->_next = NULL;
+    arena->_cleanups = NULL;
+
+    if(release)
     {
-        list->_head = new;
-        list->_tail = new;
+        while(list->_count > 0)
+            _sa_region_list_pop_front(list, &arena->_backing);
+
+        size_t i;
+        for(i = 0; i < arena->_limbo_count; i++)
+            arena->_limbo[i]._release = 1;
     }
-    else
+
+    // pairs with the acquire in sarena_epoch_enter()
+    batch._epoch = __atomic_fetch_add(&arena->_epoch->_global, 1,
+            __ATOMIC_SEQ_CST);
+
+    _sarena_limbo_push(arena, &batch);
+    _sarena_reclaim(arena, 0);
+
+    if(list->_head == NULL)
     {
-        list->_tail->_next = new;
-        list->_tail = new;
-    }
+        size_t cap = release ? arena->_region_cap : first_cap;
 
-    list->_count++;
+        if(_sa_region_list_push_back(list, cap, &arena->_backing) != 0)
+        {
+            while(list->_head == NULL)
+                _sarena_reclaim(arena, 1);
+        }
+    }
 
-    return 0;
+    arena->_hot._curr = list->_head;
 }
 
-static void _sa_region_list_pop_front(sa_region_list* list)
+/* Adds 'batch' after the batches set aside before, merging it into the most
+ * recent one if there are too many. The merged batch waits for the readers
+ * of the newer one. */
+static void _sarena_limbo_push(sarena* arena, const sa_limbo* batch)
 {
-    if(list->_head == list->_tail)
+    if(arena->_limbo_count < _SA_LIMBO_MAX)
     {
-        _sa_region_destroy(list->_head);
-        list->_head = NULL;
-        list->_tail = NULL;
+        arena->_limbo[arena->_limbo_count++] = *batch;
+        return;
     }
-    else
-    {
-        sa_region* old_head = list->_head;
 
-        list->_head = list->_head->_next;
+    sa_limbo* last = &arena->_limbo[_SA_LIMBO_MAX - 1];
 
-        _sa_region_destroy(old_head);
-    }
+    last->_tail->_next = batch->_head;
+    last->_tail = batch->_tail;
+    last->_count += batch->_count;
+    last->_epoch = batch->_epoch;
+    last->_release = last->_release && batch->_release;
 
-    list->_count--;
+    // the callbacks of the newer batch run first
+    if(batch->_cleanups != NULL)
+    {
+        sa_cleanup* oldest = batch->_cleanups;
+        while(oldest->_prev != NULL)
+            oldest = oldest->_prev;
+
+        oldest->_prev = last->_cleanups;
+        last->_cleanups = batch->_cleanups;
+    }
 }
 
-/* -------------------------------------------------------------------------- */
+/* Takes back the batches set aside which no reader can still use, oldest
+ * first. Their cleanup callbacks run, then their regions are emptied and
+ * appended to the region list, or freed if they were released by
+ * sarena_reset() and 'keep' is 0. */
+static void _sarena_reclaim(sarena* arena, int keep)
+{
+    if(arena->_limbo_count == 0) return;
 
-static int _sarena_init(sarena* arena, size_t region_cap);
-static void* _sarena_malloc(sarena* arena, size_t size);
+    size_t oldest = _sa_epoch_oldest(arena->_epoch);
+    size_t ready = 0;
 
-/* -------------------------------------------------------------------------- */
+    while((ready < arena->_limbo_count) &&
+            (arena->_limbo[ready]._epoch < oldest))
+        ready++;
 
-sarena* sarena_create(size_t region_cap)
+    if(ready == 0) return;
+
+    sa_limbo batches[_SA_LIMBO_MAX];
+    memcpy(batches, arena->_limbo, ready * sizeof(sa_limbo));
+
+    arena->_limbo_count -= ready;
+    memmove(arena->_limbo, arena->_limbo + ready,
+            arena->_limbo_count * sizeof(sa_limbo));
+
+    size_t i;
+    for(i = 0; i < ready; i++)
+        _sarena_take_back(arena, &batches[i], keep);
+}
+
+static void _sarena_take_back(sarena* arena, sa_limbo* batch, int keep)
 {
-    sarena* new = (sarena*)malloc(sizeof(sarena));
-    if(new == NULL) return NULL;
+    sa_region_list* list = &arena->_regions;
+    sa_cleanup* cleanup = batch->_cleanups;
+
+    while(cleanup != NULL)
+    {
+        sa_cleanup* prev = cleanup->_prev;
+
+        cleanup->_fn(cleanup->_ctx);
+        cleanup = prev;
+    }
 
-    int status = _sarena_init(new, region_cap);
+    sa_region* it = batch->_head;
 
-    if(status != 0)
+    while(it != NULL)
     {
-        free(new);
-        return NULL;
+        sa_region* next = it->_next;
+
+        if(batch->_release && !keep)
+            _sa_region_destroy(it, &arena->_backing);
+        else
+        {
+            _sa_region_rewind(it, 0);
+            it->_next = NULL;
+
+            if(list->_head == NULL)
+                list->_head = it;
+            else
+                list->_tail->_next = it;
+
+            list->_tail = it;
+            list->_count++;
+        }
+
+        it = next;
     }
-    else return new;
 }
 
-void sarena_destroy(sarena* arena)
+/* Lowers '_fast_cap' of the region which just became active, so the
+ * allocation crossing 'prefetch_percent' percent of it takes the out-of-line
+ * path and calls _sarena_prefetch(). */
+static void _sarena_arm_prefetch(sarena* arena)
 {
-    if(arena == NULL) return;
+    size_t percent = arena->_prefetch_percent;
+    if(percent == 0) return;
 
-    while(arena->_regions._count > 0)
-        _sa_region_list_pop_front(&arena->_regions);
+    sa_region* curr = arena->_hot._curr;
+    size_t total_cap = curr->_total_cap;
 
-    arena->_region_cap = 0;
-    arena->_rewind_it = NULL;
-    free(arena);
+    curr->_fast_cap = (total_cap / 100) * percent +
+        ((total_cap % 100) * percent) / 100;
 }
 
-void* sarena_malloc(sarena* arena, size_t size)
+/* Prepares the region after the active one. A new region is allocated here or
+ * by the background thread, and _sarena_find_region() links it in once the
+ * active region is full. Failing to allocate it is not an error, as the
+ * allocation is retried then. */
+static void _sarena_prefetch(sarena* arena)
 {
-    if(arena == NULL) return NULL;
+    sa_region* curr = arena->_hot._curr;
 
-    void* alloc_addr = _sarena_malloc(arena, size);
+    curr->_fast_cap = curr->_total_cap;
 
-    return alloc_addr;
+    if(arena->_prefetch_percent == 0) return;
+
+    if(curr->_next != NULL)
+        _sa_region_prefetch(curr->_next);
+    else if(arena->_prefetcher != NULL)
+        _sa_prefetcher_request(arena->_prefetcher, arena->_next_cap);
+    else
+    {
+        size_t cap = arena->_next_cap;
+
+        if(_sa_region_list_insert_after(&arena->_regions, curr, cap,
+                    &arena->_backing) != 0)
+            return;
+
+        _SA_TRACE(arena, SARENA_TRACE_REGION, region, curr->_next->_mem_pool,
+                curr->_next->_total_cap);
+
+        _sarena_grow(arena);
+        _sa_region_prefault(curr->_next);
+    }
 }
 
-void* sarena_calloc(sarena* arena, size_t size)
+/* Lock-free allocation. Every reservation is a multiple of the arena's
+ * alignment, so the reserved offset is always aligned to it. Larger
+ * alignments are satisfied by reserving the worst-case padding up front.
+ *
+ * A reservation which overflows the region leaves '_used_cap' above
+ * '_total_cap', which marks the region as full for all threads. */
+static void* _sarena_malloc_concurrent(sarena* arena, size_t size,
+        size_t alignment)
 {
-    if(arena == NULL) return NULL;
+    size_t pad = alignment - arena->_hot._alignment;
 
-    void* alloc_addr = _sarena_malloc(arena, size);
+    if(size > SIZE_MAX - pad - arena->_hot._alignment)
+        return NULL;
 
-    if(alloc_addr != NULL)
-        memset(alloc_addr, 0, size);
+    size_t reserve = _sa_align_up(size, arena->_hot._alignment) + pad;
 
-    return alloc_addr;
+    if(pad > 0)
+        __atomic_fetch_add(&arena->_hot._waste, pad, __ATOMIC_RELAXED);
+
+    while(1)
+    {
+        sa_region* curr = __atomic_load_n(&arena->_hot._curr, __ATOMIC_ACQUIRE);
+
+        if((arena->_vm_base == NULL) &&
+                (reserve > __atomic_load_n(&arena->_next_cap, __ATOMIC_RELAXED)))
+        {
+            sa_region* dedicated = _sarena_claim_next_concurrent(arena, curr,
+                    reserve);
+            if(dedicated == NULL)
+                dedicated = _sarena_insert_concurrent(arena, curr, reserve,
+                        reserve);
+            if(dedicated == NULL) return NULL;
+
+            return (void*)_sa_align_up((uintptr_t)dedicated->_mem_pool,
+                    alignment);
+        }
+
+        size_t old_used = __atomic_fetch_add(&curr->_used_cap, reserve,
+                __ATOMIC_RELAXED);
+        size_t total_cap = __atomic_load_n(&curr->_total_cap,
+                __ATOMIC_ACQUIRE);
+
+        if((old_used <= total_cap) && (reserve <= total_cap - old_used))
+        {
+            return (void*)_sa_align_up(
+                    (uintptr_t)(curr->_mem_pool + old_used), alignment);
+        }
+
+        // in VM arenas, the reserved range stays valid once it is committed
+        if(arena->_vm_base != NULL)
+        {
+            if((old_used > arena->_vm_pool_cap) ||
+                    (reserve > arena->_vm_pool_cap - old_used) ||
+                    (_sarena_vm_commit(arena, old_used + reserve) != 0))
+                return NULL;
+
+            return (void*)_sa_align_up(
+                    (uintptr_t)(curr->_mem_pool + old_used), alignment);
+        }
+
+        if(_sarena_advance_concurrent(arena, curr) != 0)
+            return NULL;
+    }
 }
 
-void sarena_rewind(sarena* arena)
+/* Reserves the first 'reserve' bytes of the region after 'curr' and attempts
+ * to make it the active region, if it is empty and large enough. This reuses
+ * the regions left behind by a rewind, like _sarena_find_region() does.
+ *
+ * Return value:
+ * ON SUCCESS: the region after 'curr';
+ * ON FAILURE: NULL, if there is no such region or another thread has started
+ * allocating from it. */
+static sa_region* _sarena_claim_next_concurrent(sarena* arena,
+        sa_region* curr, size_t reserve)
 {
-    if(arena == NULL) return;
+    sa_region* next = __atomic_load_n(&curr->_next, __ATOMIC_ACQUIRE);
 
-    if(arena->_regions._count == 0) 
-        return;
+    if((next == NULL) ||
+            (__atomic_load_n(&next->_total_cap, __ATOMIC_ACQUIRE) < reserve))
+        return NULL;
 
-    sa_region* it = arena->_regions._head;
+    size_t used = 0;
 
-    for(; it != NULL; it = it->_next)
-        it->_used_cap = 0;
+    if(!__atomic_compare_exchange_n(&next->_used_cap, &used, reserve, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return NULL;
+
+    // failure means another thread has already advanced past 'curr'
+    __atomic_compare_exchange_n(&arena->_hot._curr, &curr, next, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
 
-    // start rewinding if more regions exist
-    if(arena->_regions._count > 1)
-        arena->_rewind_it = arena->_regions._head;
+    return next;
 }
 
-void sarena_reset(sarena* arena)
+/* Links a new region of 'total_cap' bytes right after 'curr' and attempts to
+ * make it the active region. The first 'used_cap' bytes of the new region are
+ * reserved for the caller before it becomes visible to other threads. */
+static sa_region* _sarena_insert_concurrent(sarena* arena, sa_region* curr,
+        size_t total_cap, size_t used_cap)
 {
-    if(arena == NULL) return;
+    sa_region* new = _sa_region_alloc(total_cap, &arena->_backing);
+    if(new == NULL) return NULL;
 
-    while(arena->_regions._count > 1)
-        _sa_region_list_pop_front(&arena->_regions);
+    new->_used_cap = used_cap;
 
-    arena->_regions._head->_used_cap = 0;
-    arena->_rewind_it = NULL;
-}
+    sa_region* next = __atomic_load_n(&curr->_next, __ATOMIC_ACQUIRE);
+    do new->_next = next;
+    while(!__atomic_compare_exchange_n(&curr->_next, &next, new, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-/* -------------------------------------------------------------------------- */
+    __atomic_fetch_add(&arena->_regions._count, 1, __ATOMIC_RELAXED);
 
-static int _sarena_init(sarena* arena, size_t region_cap)
-{
-    if(region_cap == 0) return 2;
+    _sarena_fix_tail_concurrent(arena);
+    _SA_TRACE(arena, SARENA_TRACE_REGION, region, new->_mem_pool,
+            new->_total_cap);
 
-    arena->_region_cap = region_cap;
-    arena->_rewind_it = NULL;
-    _sa_region_list_init(&arena->_regions);
+    // failure means another thread has already advanced past 'curr'
+    __atomic_compare_exchange_n(&arena->_hot._curr, &curr, new, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
 
-    int status = _sa_region_list_push_back(&arena->_regions, region_cap);
-    if(status == 0) return 0;
-    else return 1;
+    return new;
 }
 
-static void* _sarena_malloc(sarena* arena, size_t size)
+/* Makes the region after 'curr' the active one, creating it if 'curr' is the
+ * tail. If multiple threads race to create the next region, only one of them
+ * gets linked into the list. */
+static int _sarena_advance_concurrent(sarena* arena, sa_region* curr)
 {
-    if((size > arena->_region_cap) || (size == 0))
-        return NULL;
+    sa_region* next = __atomic_load_n(&curr->_next, __ATOMIC_ACQUIRE);
 
-    sa_region* curr_region = (arena->_rewind_it == NULL) ?
-        arena->_regions._tail : arena->_rewind_it;
+    if(next == NULL)
+    {
+        size_t cap = __atomic_load_n(&arena->_next_cap, __ATOMIC_RELAXED);
 
-    size_t curr_region_cap = curr_region->_total_cap - curr_region->_used_cap;
+        sa_region* new = _sa_region_alloc(cap, &arena->_backing);
+        if(new == NULL) return 1;
 
-    if(size > curr_region_cap) // not enough memory in current region
-    {
-        if(arena->_rewind_it == NULL) // if not rewinding, push back a region
+        if(__atomic_compare_exchange_n(&curr->_next, &next, new, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
         {
-            int status = _sa_region_list_push_back(&arena->_regions, arena->_region_cap);
-            if(status != 0)
-                return NULL;
+            next = new;
+            _sarena_grow(arena);
+            __atomic_fetch_add(&arena->_regions._count, 1, __ATOMIC_RELAXED);
+            _sarena_fix_tail_concurrent(arena);
+            _SA_TRACE(arena, SARENA_TRACE_REGION, region, new->_mem_pool,
+                    new->_total_cap);
         }
-        else // if rewinding, advance rewind iterator
-        {
-            arena->_rewind_it = arena->_rewind_it->_next;
+        else // 'next' now holds the winning region
+            _sa_region_destroy(new, &arena->_backing);
+    }
 
-            // if at the tail, turn of rewinding
-            if(arena->_rewind_it == arena->_regions._tail)
-                arena->_rewind_it = NULL;
-        }
+    // failure means another thread has already advanced past 'curr'
+    __atomic_compare_exchange_n(&arena->_hot._curr, &curr, next, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
 
-        // advance the curr_region ptr after allocing region/advancing rewind
-        curr_region = curr_region->_next;
-    }
+    return 0;
+}
 
-    void* alloc_addr = curr_region->_mem_pool + curr_region->_used_cap;
-    curr_region->_used_cap += size;
+/* The tail may lag behind if regions are installed back-to-back. Advances it
+ * until it points at the last region in the list. */
+static void _sarena_fix_tail_concurrent(sarena* arena)
+{
+    sa_region* tail = __atomic_load_n(&arena->_regions._tail,
+            __ATOMIC_ACQUIRE);
+    sa_region* tail_next;
 
-    return alloc_addr;
+    while((tail_next = __atomic_load_n(&tail->_next,
+                    __ATOMIC_ACQUIRE)) != NULL)
+    {
+        if(__atomic_compare_exchange_n(&arena->_regions._tail, &tail,
+                    tail_next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            tail = tail_next;
+    }
 }
 
 #endif // SARENA_IMPLEMENTATION
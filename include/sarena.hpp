@@ -0,0 +1,228 @@
+/* MIT License
+ *
+ * Copyright (c) 2025 Novak Stevanović
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* -------------------------------------------------------------------------- */
+/* START */
+/* -------------------------------------------------------------------------- */
+
+/* C++ interface of SArena. Everything lives in namespace 'sa', since the name
+ * 'sarena' is already taken by the C type. Requires C++11, and C++17 for
+ * sa::memory_resource. */
+
+#ifndef SARENA_HPP
+#define SARENA_HPP
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if (__cplusplus >= 201703L) && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define SARENA_HAVE_PMR 1
+#endif
+#endif
+
+#include "sarena.h"
+
+namespace sa
+{
+
+/* -------------------------------------------------------------------------- */
+
+/* Allocates memory for 'size' bytes aligned to 'alignment' from the arena.
+ * Unlike sarena_malloc_aligned(), a 'size' of 0 yields a valid block.
+ *
+ * Throws std::bad_alloc if the allocation fails. */
+
+inline void* allocate(sarena* arena, std::size_t size, std::size_t alignment)
+{
+    void* ptr = sarena_malloc_aligned(arena, (size != 0) ? size : 1,
+            alignment);
+    if(ptr == nullptr) throw std::bad_alloc();
+
+    return ptr;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Allocator meeting the Allocator requirements of the standard library, for
+ * placing container storage and nodes inside an arena:
+ *
+ * std::vector<int, sa::allocator<int>> v{sa::allocator<int>(arena)};
+ *
+ * deallocate() does nothing - the memory is reclaimed when the arena is
+ * rewinded, reset or destroyed, which must not happen while the containers
+ * using it are still alive. Allocators compare equal if they use the same
+ * arena. */
+
+template<class T>
+class allocator
+{
+public:
+    using value_type = T;
+
+    explicit allocator(sarena* arena) noexcept : _arena(arena) {}
+
+    template<class U>
+    allocator(const allocator<U>& other) noexcept : _arena(other.arena()) {}
+
+    T* allocate(std::size_t n)
+    {
+        if(n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+            throw std::bad_alloc();
+
+        return static_cast<T*>(sa::allocate(_arena, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, std::size_t n) noexcept
+    {
+        (void)ptr; (void)n;
+    }
+
+    sarena* arena() const noexcept { return _arena; }
+
+private:
+    sarena* _arena;
+};
+
+template<class T, class U>
+bool operator==(const allocator<T>& lhs, const allocator<U>& rhs) noexcept
+{
+    return lhs.arena() == rhs.arena();
+}
+
+template<class T, class U>
+bool operator!=(const allocator<T>& lhs, const allocator<U>& rhs) noexcept
+{
+    return lhs.arena() != rhs.arena();
+}
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef SARENA_HAVE_PMR
+
+/* Polymorphic memory resource backed by an arena, for std::pmr containers:
+ *
+ * sa::memory_resource resource(arena);
+ * std::pmr::unordered_map<int, int> map(&resource);
+ *
+ * As with sa::allocator, deallocation does nothing. */
+
+class memory_resource : public std::pmr::memory_resource
+{
+public:
+    explicit memory_resource(sarena* arena) noexcept : _arena(arena) {}
+
+    sarena* arena() const noexcept { return _arena; }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return sa::allocate(_arena, bytes, alignment);
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes,
+            std::size_t alignment) override
+    {
+        (void)ptr; (void)bytes; (void)alignment;
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other)
+        const noexcept override
+    {
+        const memory_resource* resource =
+            dynamic_cast<const memory_resource*>(&other);
+
+        return (resource != nullptr) && (resource->_arena == _arena);
+    }
+
+    sarena* _arena;
+};
+
+#endif // SARENA_HAVE_PMR
+
+/* -------------------------------------------------------------------------- */
+
+/* Takes a mark on construction and rewinds the arena to it on destruction, so
+ * all memory allocated from the arena within the scope is released when the
+ * scope ends:
+ *
+ * {
+ *     sa::scope scope(arena);
+ *     ... temporary allocations ...
+ * } */
+
+class scope
+{
+public:
+    explicit scope(sarena* arena) noexcept :
+        _arena(arena), _mark(sarena_mark(arena)) {}
+
+    ~scope() { sarena_rewind_to(_arena, _mark); }
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+private:
+    sarena* _arena;
+    sarena_mark_t _mark;
+};
+
+/* -------------------------------------------------------------------------- */
+
+template<class T>
+void destroy_callback(void* ctx)
+{
+    static_cast<T*>(ctx)->~T();
+}
+
+/* Constructs an object of type T inside the arena, forwarding 'args' to its
+ * constructor. Unless T is trivially destructible, its destructor is
+ * registered with sarena_on_reset(), so it runs when the object's memory is
+ * released by the arena.
+ *
+ * Throws std::bad_alloc if an allocation fails, and anything the constructor
+ * of T throws. */
+
+template<class T, class... Args>
+T* make(sarena* arena, Args&&... args)
+{
+    void* ptr = sa::allocate(arena, sizeof(T), alignof(T));
+    T* object = ::new(ptr) T(std::forward<Args>(args)...);
+
+    if(!std::is_trivially_destructible<T>::value &&
+            (sarena_on_reset(arena, destroy_callback<T>, object) != 0))
+    {
+        object->~T();
+        throw std::bad_alloc();
+    }
+
+    return object;
+}
+
+} // namespace sa
+
+#endif // SARENA_HPP
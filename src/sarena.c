@@ -1,2 +1,3 @@
+#define _DEFAULT_SOURCE
 #define SARENA_IMPLEMENTATION
 #include "sarena.h"
@@ -0,0 +1,184 @@
+/* Regression tests for behaviour which is easy to break without noticing.
+ *
+ * Usage: test
+ *
+ * The tests include the implementation themselves, so they can check the
+ * layout of private structures. Each test aborts with a message naming the
+ * failed check; the harness exits with status 0 once all of them pass. */
+
+#define _DEFAULT_SOURCE
+#define SARENA_IMPLEMENTATION
+#include "sarena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TEST_CHECK(cond)                                                       \
+    do {                                                                       \
+        if(!(cond))                                                            \
+        {                                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,   \
+                    #cond);                                                    \
+            abort();                                                           \
+        }                                                                      \
+    } while(0)
+
+typedef struct test_case
+{
+    const char* name;
+    void (*run)(void);
+} test_case;
+
+/* -------------------------------------------------------------------------- */
+
+/* Every reader slot of an epoch domain occupies a cache line of its own, so
+ * readers never share a line with each other or with the global epoch. */
+static void test_epoch_reader_lines(void)
+{
+    size_t counts[] = { 1, 3, 64 };
+
+    size_t i;
+    for(i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        sarena_epoch* dom = sarena_epoch_create(counts[i]);
+        TEST_CHECK(dom != NULL);
+
+        size_t j;
+        for(j = 0; j < counts[i]; j++)
+            TEST_CHECK((uintptr_t)&dom->_readers[j] % _SA_CACHE_LINE == 0);
+
+        TEST_CHECK((uintptr_t)&dom->_global / _SA_CACHE_LINE !=
+                (uintptr_t)&dom->_readers[0] / _SA_CACHE_LINE);
+
+        sarena_epoch_destroy(dom);
+    }
+}
+
+/* A slot carved before a mark survives sarena_rewind_to(), and so does its
+ * place in the free list. */
+static void test_pool_rewind_to_keeps_slots(void)
+{
+    sarena* arena = sarena_create(4096);
+    TEST_CHECK(arena != NULL);
+
+    sarena_pool pool;
+    TEST_CHECK(sarena_pool_init(&pool, arena, 48) == 0);
+
+    void* kept = sarena_pool_alloc(&pool);
+    void* freed = sarena_pool_alloc(&pool);
+    TEST_CHECK((kept != NULL) && (freed != NULL));
+
+    sarena_pool_free(&pool, freed);
+
+    sarena_mark_t mark = sarena_mark(arena);
+    TEST_CHECK(sarena_malloc(arena, 1000) != NULL);
+    sarena_rewind_to(arena, mark);
+
+    // freed before the mark
+    TEST_CHECK(sarena_pool_alloc(&pool) == freed);
+
+    mark = sarena_mark(arena);
+    TEST_CHECK(sarena_malloc(arena, 1000) != NULL);
+    sarena_rewind_to(arena, mark);
+
+    // freed after the rewind
+    sarena_pool_free(&pool, kept);
+    TEST_CHECK(sarena_pool_alloc(&pool) == kept);
+
+    sarena_destroy(arena);
+}
+
+/* A pool used next to scoped scratch memory reaches a steady state in which
+ * it takes nothing more from the arena. */
+static void test_pool_rewind_to_steady(void)
+{
+    sarena* arena = sarena_create(4096);
+    TEST_CHECK(arena != NULL);
+
+    sarena_pool pool;
+    TEST_CHECK(sarena_pool_init(&pool, arena, 32) == 0);
+
+    size_t used = 0;
+
+    int i;
+    for(i = 0; i < 100; i++)
+    {
+        void* slots[8];
+
+        size_t j;
+        for(j = 0; j < 8; j++)
+            TEST_CHECK((slots[j] = sarena_pool_alloc(&pool)) != NULL);
+
+        sarena_mark_t mark = sarena_mark(arena);
+        TEST_CHECK(sarena_malloc(arena, 3000) != NULL);
+        sarena_rewind_to(arena, mark);
+
+        for(j = 0; j < 8; j++)
+            sarena_pool_free(&pool, slots[j]);
+
+        sarena_stats_t stats;
+        sarena_stats(arena, &stats);
+
+        if(i == 0) used = stats.used;
+        TEST_CHECK(stats.used == used);
+    }
+
+    sarena_destroy(arena);
+}
+
+/* Slots carved after the mark are released by sarena_rewind_to(), even if
+ * the arena hands their memory out again before the pool is used. */
+static void test_pool_rewind_to_drops_slots(void)
+{
+    sarena* arena = sarena_create(4096);
+    TEST_CHECK(arena != NULL);
+
+    sarena_pool pool;
+    TEST_CHECK(sarena_pool_init(&pool, arena, 32) == 0);
+
+    sarena_mark_t mark = sarena_mark(arena);
+
+    void* slot = sarena_pool_alloc(&pool);
+    TEST_CHECK(slot != NULL);
+    sarena_pool_free(&pool, slot);
+
+    sarena_rewind_to(arena, mark);
+
+    size_t size = 32 * SARENA_POOL_BATCH;
+    char* block = (char*)sarena_malloc(arena, size);
+    TEST_CHECK(block != NULL);
+    memset(block, 0xab, size);
+
+    int i;
+    for(i = 0; i < 2 * SARENA_POOL_BATCH; i++)
+    {
+        char* other = (char*)sarena_pool_alloc(&pool);
+        TEST_CHECK(other != NULL);
+        TEST_CHECK((other + 32 <= block) || (other >= block + size));
+    }
+
+    sarena_destroy(arena);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static const test_case test_cases[] = {
+    { "epoch_reader_lines", test_epoch_reader_lines },
+    { "pool_rewind_to_keeps_slots", test_pool_rewind_to_keeps_slots },
+    { "pool_rewind_to_steady", test_pool_rewind_to_steady },
+    { "pool_rewind_to_drops_slots", test_pool_rewind_to_drops_slots },
+};
+
+int main(void)
+{
+    size_t i;
+    for(i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++)
+    {
+        test_cases[i].run();
+        printf("ok %s\n", test_cases[i].name);
+    }
+
+    return 0;
+}